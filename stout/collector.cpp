@@ -25,21 +25,28 @@ DWORD WINAPI collector::thread_proc(LPVOID params)
     Sleep(delay * 1000);
     printf("initial delay expired - baseline assessment started...\n");
 
+    // metric names don't change, so render them only once
+    std::vector<metrics::handle> mem_ws, mem_pb;
+    for (auto proc : processes) {
+        char txt[256];
+        sprintf_s(txt, "%s.mem_ws.%d", proc.symbolic_name.c_str(), proc.id);
+        mem_ws.push_back(metrics::handle(txt, metrics::histogram));
+        sprintf_s(txt, "%s.mem_pb.%d", proc.symbolic_name.c_str(), proc.id);
+        mem_pb.push_back(metrics::handle(txt, metrics::histogram));
+    }
+
     while (true) {
         // todo: use PDH?
-        for (auto proc : processes) {
+        for (size_t i = 0; i < processes.size(); ++i) {
             PROCESS_MEMORY_COUNTERS_EX pmc;
-            if (!GetProcessMemoryInfo(proc.h_proc, (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc)))
+            if (!GetProcessMemoryInfo(processes[i].h_proc, (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc)))
             {
                 continue;
             }
             else
             {
-                char txt[256];
-                sprintf_s(txt, "%s.mem_ws.%d", proc.symbolic_name.c_str(), proc.id);
-                metrics::measure(txt, pmc.WorkingSetSize / 1024);
-                sprintf_s(txt, "%s.mem_pb.%d", proc.symbolic_name.c_str(), proc.id);
-                metrics::measure(txt, pmc.PrivateUsage / 1024);
+                metrics::measure(mem_ws[i], pmc.WorkingSetSize / 1024);
+                metrics::measure(mem_pb[i], pmc.PrivateUsage / 1024);
                 // todo: log
             }
         }
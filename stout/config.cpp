@@ -16,6 +16,10 @@ const char* value_type_to_string(e_metric_value type) {
         case min_value: return "min";
         case max_value: return "max";
         case stddev_value: return "stddev";
+        case p50_value: return "p50";
+        case p90_value: return "p90";
+        case p99_value: return "p99";
+        case p999_value: return "p999";
         default: return "?";
     }
 }
@@ -67,6 +71,10 @@ watch parse_watch(const std::string& exp)
     else if (!_strcmpi("min", pos)) w.value_type = min_value;
     else if (!_strcmpi("max", pos)) w.value_type = max_value;
     else if (!_strcmpi("stddev", pos)) w.value_type = stddev_value;
+    else if (!_strcmpi("p50", pos)) w.value_type = p50_value;
+    else if (!_strcmpi("p90", pos)) w.value_type = p90_value;
+    else if (!_strcmpi("p99", pos)) w.value_type = p99_value;
+    else if (!_strcmpi("p999", pos)) w.value_type = p999_value;
     else throw stout_exception(err_msg.c_str());
 
     pos = strtok_s(NULL, " ", &ctxt);
@@ -153,6 +161,13 @@ void config::ParseCommon()
     keys.get(m_initial_delay, "DELAY", 5);
     keys.get(m_sampling_time, "SAMPLING_TIME", 60);
     keys.get(m_testrun_duration, "DURATION", 60);
+    keys.get(m_flush_threads, "FLUSH_THREADS", -1);
+    if (m_flush_threads < 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        m_flush_threads = (std::min)((int)si.dwNumberOfProcessors - 1, 64);
+    }
+    else if (m_flush_threads > 64) throw stout_exception("Valid FLUSH_THREADS is 0-64");
 
     string err;
     keys.get(err, "ON_ERROR", "LOG");
@@ -169,9 +184,77 @@ void config::ParseBackends()
     }
 }
 
+std::string trim(const std::string& s)
+{
+    auto first = s.find_first_not_of(" \t");
+    if (first == string::npos) return "";
+    auto last = s.find_last_not_of(" \t");
+    return s.substr(first, last - first + 1);
+}
+
+// splits backend arguments at commas which are not quoted. text after
+// unquoted ';' is a comment
+std::vector<std::string> split_backend_args(const std::string& args)
+{
+    std::vector<std::string> parts(1);
+    bool quoted = false;
+    for (auto ch : args) {
+        if (ch == '"') quoted = !quoted;
+        else if (!quoted && ch == ';') break;
+        else if (!quoted && ch == ',') parts.push_back("");
+        else parts.back() += ch;
+    }
+    for (auto& part : parts) part = trim(part);
+    return parts;
+}
+
+// e.g. JSON = "d:\load.json", QUEUE = 8, OVERFLOW = DROP_NEWEST, SLOW = 5000
 void config::AddBackend(const std::string& backend_name, const std::string& args)
 {   
-    backend be = { backend_name, args };
+    backend be = { trim(backend_name), args, "", 4, false, 10000, 0, 0, 5, false };
+    string err_msg = "Invalid backend: " + be.name + " = " + args;
+
+    auto parts = split_backend_args(args);
+    be.target = parts[0];
+    for (size_t i = 1; i < parts.size(); ++i) {
+        auto pos = parts[i].find('=');
+        if (pos == string::npos) throw stout_exception(err_msg.c_str());
+        auto key = trim(parts[i].substr(0, pos));
+        auto val = trim(parts[i].substr(pos + 1));
+
+        if (!_strcmpi(key.c_str(), "QUEUE")) {
+            be.queue_size = strtol(val.c_str(), NULL, 10);
+            if (be.queue_size < 1 || be.queue_size > 1024) throw stout_exception((err_msg + " (valid QUEUE is 1-1024)").c_str());
+        }
+        else if (!_strcmpi(key.c_str(), "OVERFLOW")) {
+            if (!_strcmpi(val.c_str(), "DROP_NEWEST")) be.drop_newest = true;
+            else if (!_strcmpi(val.c_str(), "DROP_OLDEST")) be.drop_newest = false;
+            else throw stout_exception((err_msg + " (valid OVERFLOW is DROP_NEWEST or DROP_OLDEST)").c_str());
+        }
+        else if (!_strcmpi(key.c_str(), "SLOW")) {
+            be.slow_ms = strtol(val.c_str(), NULL, 10);
+            if (be.slow_ms < 0) throw stout_exception((err_msg + " (SLOW must not be negative)").c_str());
+        }
+        else if (!_strcmpi(key.c_str(), "SYNC")) {
+            be.sync_every = strtol(val.c_str(), NULL, 10);
+            if (be.sync_every < 0) throw stout_exception((err_msg + " (SYNC must not be negative)").c_str());
+        }
+        else if (!_strcmpi(key.c_str(), "ROTATE")) {
+            be.rotate_mb = strtol(val.c_str(), NULL, 10);
+            if (be.rotate_mb < 0) throw stout_exception((err_msg + " (ROTATE must not be negative)").c_str());
+        }
+        else if (!_strcmpi(key.c_str(), "KEEP")) {
+            be.rotate_keep = strtol(val.c_str(), NULL, 10);
+            if (be.rotate_keep < 1 || be.rotate_keep > 99) throw stout_exception((err_msg + " (valid KEEP is 1-99)").c_str());
+        }
+        else if (!_strcmpi(key.c_str(), "FORMAT")) {
+            if (!_strcmpi(val.c_str(), "NDJSON")) be.ndjson = true;
+            else if (!_strcmpi(val.c_str(), "PRETTY")) be.ndjson = false;
+            else throw stout_exception((err_msg + " (valid FORMAT is PRETTY or NDJSON)").c_str());
+        }
+        else throw stout_exception(err_msg.c_str());
+    }
+
     m_backends.push_back(be);
 }
 
@@ -12,7 +12,11 @@ enum e_metric_value {
     avg_value,
     min_value,
     max_value,
-    stddev_value
+    stddev_value,
+    p50_value,
+    p90_value,
+    p99_value,
+    p999_value
 };
 
 const char* value_type_to_string(e_metric_value type);
@@ -52,6 +56,14 @@ struct watch {
 struct backend {
     std::string name;
     std::string args;
+    std::string target;     // first argument without quotes, e.g. file name
+    int queue_size;         // QUEUE option, snapshots waiting for the backend
+    bool drop_newest;       // OVERFLOW option, what to drop when queue is full
+    int slow_ms;            // SLOW option, slower calls are reported
+    int sync_every;         // SYNC option, flushes between syncing file to disk
+    int rotate_mb;          // ROTATE option, file size which triggers rotation
+    int rotate_keep;        // KEEP option, number of rotated files kept
+    bool ndjson;            // FORMAT option, one line per flush
 };
 
 typedef std::vector<watch> watch_list;
@@ -75,6 +87,7 @@ public:
     int initial_delay() const { return m_initial_delay; }
     int sampling_time() const { return m_sampling_time; }
     int testrun_duration() const { return m_testrun_duration; }
+    int flush_threads() const { return m_flush_threads; }
     e_error_reaction error_reaction() const { return m_error_reaction; }
     const backend_list& backends() const { return m_backends; }
     const processes_list& processes() const { return m_processes; }
@@ -96,6 +109,7 @@ private:
     int m_initial_delay;
     int m_sampling_time;
     int m_testrun_duration;
+    int m_flush_threads;
     e_error_reaction m_error_reaction;
 };
 
@@ -0,0 +1,55 @@
+#include "stdafx.h"
+#include "arena.h"
+#include "metrics.h"
+
+namespace metrics
+{
+    const size_t arena_alignment = 8;
+
+    arena::arena(size_t chunk_size) :
+        m_chunk_size(chunk_size),
+        m_current(0),
+        m_used(0)
+    {;}
+
+    arena::~arena()
+    {
+        FOR_EACH (auto& c, m_chunks) ::operator delete(c.memory);
+    }
+
+    void* arena::allocate(size_t size)
+    {
+        size = (size + arena_alignment - 1) & ~(arena_alignment - 1);
+
+        // skip chunks which are too small, the rest of them is wasted until reset
+        while (m_current < m_chunks.size() && m_chunks[m_current].size - m_used < size) {
+            ++m_current;
+            m_used = 0;
+        }
+
+        if (m_current == m_chunks.size()) {
+            chunk c;
+            c.size = size > m_chunk_size ? size : m_chunk_size;
+            c.memory = static_cast<char*>(::operator new(c.size));
+            m_chunks.push_back(c);
+            m_used = 0;
+        }
+
+        void* p = m_chunks[m_current].memory + m_used;
+        m_used += size;
+        return p;
+    }
+
+    void arena::reset()
+    {
+        m_current = 0;
+        m_used = 0;
+    }
+
+    size_t arena::capacity() const
+    {
+        size_t total = 0;
+        FOR_EACH (auto& c, m_chunks) total += c.size;
+        return total;
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <new>
+
+namespace metrics
+{
+    /**
+    * Bump allocator for data which lives until the next flush. Allocation
+    * just advances a pointer in the current chunk, individual blocks are
+    * never freed, and reset() makes all chunks available again without
+    * returning them to the heap. Once the arena has grown to the size
+    * needed by one flush period, allocating performs no heap calls.
+    *
+    * Not thread-safe, each storage has its own arena.
+    */
+    class arena
+    {
+        struct chunk
+        {
+            char* memory;
+            size_t size;
+        };
+
+        std::vector<chunk> m_chunks;
+        size_t m_chunk_size;
+        size_t m_current;   // index of the chunk being filled
+        size_t m_used;      // bytes used in the current chunk
+
+    public:
+        /// `chunk_size` is the size of memory blocks requested from the heap,
+        /// larger allocations get a chunk of their own
+        explicit arena(size_t chunk_size = 64 * 1024);
+        ~arena();
+
+        /// returns memory aligned to 8 bytes, throws std::bad_alloc on failure
+        void* allocate(size_t size);
+
+        /// releases all allocations at once, keeps the chunks for reuse
+        void reset();
+
+        /// returns the total size of chunks owned by the arena
+        size_t capacity() const;
+
+    private:
+        arena(const arena&);
+        arena& operator=(const arena&);
+    };
+
+    /**
+    * Standard allocator taking memory from an arena, so standard containers
+    * can be reset together with the arena. deallocate() does nothing. A
+    * default-constructed allocator has no arena and uses the heap, so
+    * containers work the usual way when no arena is given.
+    */
+    template <typename T>
+    class arena_allocator
+    {
+        template <typename U> friend class arena_allocator;
+        arena* m_arena;
+
+    public:
+        typedef T value_type;
+        typedef T* pointer;
+        typedef const T* const_pointer;
+        typedef T& reference;
+        typedef const T& const_reference;
+        typedef size_t size_type;
+        typedef ptrdiff_t difference_type;
+
+        template <typename U> struct rebind { typedef arena_allocator<U> other; };
+
+        arena_allocator() : m_arena(NULL) { ; }
+        explicit arena_allocator(arena* a) : m_arena(a) { ; }
+        template <typename U> arena_allocator(const arena_allocator<U>& other) : m_arena(other.m_arena) { ; }
+
+        pointer allocate(size_type n, const void* = 0)
+        {
+            if (m_arena) return static_cast<pointer>(m_arena->allocate(n * sizeof(T)));
+            return static_cast<pointer>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(pointer p, size_type)
+        {
+            if (!m_arena) ::operator delete(p);
+        }
+
+        size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+        void construct(pointer p, const T& value) { new (p) T(value); }
+        void destroy(pointer p) { p->~T(); }
+
+        pointer address(reference r) const { return &r; }
+        const_pointer address(const_reference r) const { return &r; }
+
+        template <typename U> bool operator==(const arena_allocator<U>& other) const { return m_arena == other.m_arena; }
+        template <typename U> bool operator!=(const arena_allocator<U>& other) const { return m_arena != other.m_arena; }
+    };
+}
@@ -0,0 +1,257 @@
+#include "stdafx.h"
+#include "arrow_stream.h"
+
+namespace metrics
+{
+    // minimal FlatBuffers builder for Arrow metadata. objects are written
+    // front to back, so a table reserves its offsets to objects which are
+    // written after it, and they are linked by link()
+    class flatbuffer_builder
+    {
+        std::vector<char> m_data;
+
+    public:
+        static const int max_slots = 8;
+
+        flatbuffer_builder() : m_data(4, 0) { ; } // offset of the root table
+
+        const std::vector<char>& data() const { return m_data; }
+
+        void align(size_t alignment) { while (m_data.size() % alignment) m_data.push_back(0); }
+
+        template <typename T> void set(size_t pos, T value) { memcpy(&m_data[pos], &value, sizeof(value)); }
+
+        // points the offset at `pos` to the object at `target`
+        void link(size_t pos, size_t target) { set(pos, (unsigned int)(target - pos)); }
+
+        // writes a table with fields of the given sizes by slot, 0 for absent
+        // ones. positions of the fields are returned in `fields`
+        size_t add_table(const unsigned char* sizes, int slots, size_t* fields);
+
+        size_t add_string(const char* text);
+
+        // writes a vector of `count` elements of `size` bytes, elements start 4 bytes after it
+        size_t add_vector(size_t count, size_t size);
+    };
+
+    size_t flatbuffer_builder::add_table(const unsigned char* sizes, int slots, size_t* fields)
+    {
+        // fields follow the offset of the vtable from the largest, so all are aligned
+        unsigned short offsets[max_slots];
+        bool wide = false;
+        for (int i = 0; i < slots; ++i) wide = wide || sizes[i] == 8;
+        unsigned short inline_size = wide ? 8 : 4;
+        for (unsigned char size = 8; size > 0; size /= 2) {
+            for (int i = 0; i < slots; ++i) {
+                if (sizes[i] != size) continue;
+                offsets[i] = inline_size;
+                inline_size += size;
+            }
+        }
+
+        align(2);
+        size_t vtable = m_data.size();
+        m_data.resize(vtable + 4 + 2 * slots);
+        set(vtable, (unsigned short)(4 + 2 * slots));
+        set(vtable + 2, inline_size);
+        for (int i = 0; i < slots; ++i) set(vtable + 4 + 2 * i, sizes[i] ? offsets[i] : (unsigned short)0);
+
+        align(wide ? 8 : 4);
+        size_t table = m_data.size();
+        m_data.resize(table + inline_size);
+        set(table, (int)(table - vtable));
+        for (int i = 0; i < slots; ++i) fields[i] = sizes[i] ? table + offsets[i] : 0;
+        return table;
+    }
+
+    size_t flatbuffer_builder::add_string(const char* text)
+    {
+        align(4);
+        size_t pos = m_data.size();
+        size_t len = strlen(text);
+        m_data.resize(pos + 4 + len + 1); // zero terminated
+        set(pos, (unsigned int)len);
+        memcpy(&m_data[pos + 4], text, len);
+        return pos;
+    }
+
+    size_t flatbuffer_builder::add_vector(size_t count, size_t size)
+    {
+        size_t alignment = size < 4 ? 4 : (size > 8 ? 8 : size);
+        while ((m_data.size() + 4) % alignment) m_data.push_back(0);
+        size_t pos = m_data.size();
+        m_data.resize(pos + 4 + count * size);
+        set(pos, (unsigned int)count);
+        return pos;
+    }
+
+    // MessageHeader and Type unions, and MetadataVersion.V5 from Message.fbs and Schema.fbs
+    enum { header_schema = 1, header_dictionary_batch = 2, header_record_batch = 3 };
+    enum { type_int = 2, type_floating_point = 3, type_utf8 = 5, type_timestamp = 10 };
+    static const short metadata_v5 = 4;
+
+    static const char padding[8] = { 0 };
+
+    static size_t padded(size_t size) { return (size + 7) & ~(size_t)7; }
+
+    static long long body_length(const arrow_buffer* buffers, size_t count)
+    {
+        size_t length = 0;
+        for (size_t i = 0; i < count; ++i) length += padded(buffers[i].size);
+        return length;
+    }
+
+    // writes the root Message table, returns position of the offset of its header
+    static size_t add_message(flatbuffer_builder& fb, unsigned char header_type, long long body_length)
+    {
+        const unsigned char sizes[] = { 2, 1, 4, 8 }; // version, header_type, header, bodyLength
+        size_t fields[4];
+        fb.link(0, fb.add_table(sizes, 4, fields));
+        fb.set(fields[0], metadata_v5);
+        fb.set(fields[1], header_type);
+        fb.set(fields[3], body_length);
+        return fields[2];
+    }
+
+    static unsigned char type_id(arrow_type type)
+    {
+        switch (type) {
+        case arrow_float64: return type_floating_point;
+        case arrow_utf8: return type_utf8;
+        case arrow_timestamp_ms: return type_timestamp;
+        default: return type_int;
+        }
+    }
+
+    static size_t add_type(flatbuffer_builder& fb, arrow_type type)
+    {
+        size_t fields[2];
+        switch (type) {
+        case arrow_float64: {
+            const unsigned char sizes[] = { 2 }; // precision
+            size_t table = fb.add_table(sizes, 1, fields);
+            fb.set(fields[0], (short)2); // DOUBLE
+            return table;
+        }
+        case arrow_utf8:
+            return fb.add_table(NULL, 0, fields);
+        case arrow_timestamp_ms: {
+            const unsigned char sizes[] = { 2, 4 }; // unit, timezone
+            size_t table = fb.add_table(sizes, 2, fields);
+            fb.set(fields[0], (short)1); // MILLISECOND
+            fb.link(fields[1], fb.add_string("UTC"));
+            return table;
+        }
+        default: {
+            const unsigned char sizes[] = { 4, 1 }; // bitWidth, is_signed
+            size_t table = fb.add_table(sizes, 2, fields);
+            fb.set(fields[0], type == arrow_int8 ? 8 : (type == arrow_int32 ? 32 : 64));
+            fb.set(fields[1], (unsigned char)1);
+            return table;
+        }
+        }
+    }
+
+    static size_t add_field(flatbuffer_builder& fb, const arrow_field& field)
+    {
+        bool encoded = field.dictionary >= 0;
+        // name, nullable, type_type, type, dictionary, children
+        const unsigned char sizes[] = { 4, 1, 1, 4, (unsigned char)(encoded ? 4 : 0), 4 };
+        size_t fields[6];
+        size_t table = fb.add_table(sizes, 6, fields);
+        fb.set(fields[1], (unsigned char)field.nullable);
+        fb.set(fields[2], type_id(field.type));
+        fb.link(fields[0], fb.add_string(field.name));
+        fb.link(fields[3], add_type(fb, field.type));
+        if (encoded) {
+            const unsigned char dictionary_sizes[] = { 8, 4 }; // id, indexType
+            size_t dictionary[2];
+            fb.link(fields[4], fb.add_table(dictionary_sizes, 2, dictionary));
+            fb.set(dictionary[0], field.dictionary);
+            fb.link(dictionary[1], add_type(fb, field.index_type));
+        }
+        fb.link(fields[5], fb.add_vector(0, 4)); // readers require children, even if there are none
+        return table;
+    }
+
+    static size_t add_record_batch(flatbuffer_builder& fb, long long length, const arrow_node* nodes, size_t node_count,
+                                   const arrow_buffer* buffers, size_t buffer_count)
+    {
+        const unsigned char sizes[] = { 8, 4, 4 }; // length, nodes, buffers
+        size_t fields[3];
+        size_t table = fb.add_table(sizes, 3, fields);
+        fb.set(fields[0], length);
+
+        size_t vector = fb.add_vector(node_count, 16);
+        fb.link(fields[1], vector);
+        for (size_t i = 0; i < node_count; ++i) {
+            fb.set(vector + 4 + 16 * i, nodes[i].length);
+            fb.set(vector + 12 + 16 * i, nodes[i].null_count);
+        }
+
+        vector = fb.add_vector(buffer_count, 16);
+        fb.link(fields[2], vector);
+        long long offset = 0; // in the body
+        for (size_t i = 0; i < buffer_count; ++i) {
+            fb.set(vector + 4 + 16 * i, offset);
+            fb.set(vector + 12 + 16 * i, (long long)buffers[i].size);
+            offset += padded(buffers[i].size);
+        }
+        return table;
+    }
+
+    void arrow_stream::write_message(const std::vector<char>& metadata, const arrow_buffer* buffers, size_t buffer_count)
+    {
+        // continuation marker and size of metadata, padded so that the body is aligned
+        size_t size = padded(metadata.size());
+        int prefix[2] = { -1, (int)size };
+        m_out.write((const char*)prefix, sizeof(prefix));
+        m_out.write(&metadata[0], metadata.size());
+        m_out.write(padding, size - metadata.size());
+
+        for (size_t i = 0; i < buffer_count; ++i) {
+            if (buffers[i].size == 0) continue;
+            m_out.write((const char*)buffers[i].data, buffers[i].size);
+            m_out.write(padding, padded(buffers[i].size) - buffers[i].size);
+        }
+    }
+
+    void arrow_stream::write_schema(const arrow_field* fields, size_t count)
+    {
+        flatbuffer_builder fb;
+        size_t header = add_message(fb, header_schema, 0);
+
+        const unsigned char sizes[] = { 0, 4 }; // endianness, little by default, and fields
+        size_t schema[2];
+        fb.link(header, fb.add_table(sizes, 2, schema));
+        size_t vector = fb.add_vector(count, 4);
+        fb.link(schema[1], vector);
+        for (size_t i = 0; i < count; ++i) {
+            fb.link(vector + 4 + 4 * i, add_field(fb, fields[i]));
+        }
+        write_message(fb.data(), NULL, 0);
+    }
+
+    void arrow_stream::write_dictionary(long long id, bool delta, const arrow_node& node, const arrow_buffer* buffers, size_t buffer_count)
+    {
+        flatbuffer_builder fb;
+        size_t header = add_message(fb, header_dictionary_batch, body_length(buffers, buffer_count));
+
+        const unsigned char sizes[] = { 8, 4, 1 }; // id, data, isDelta
+        size_t fields[3];
+        fb.link(header, fb.add_table(sizes, 3, fields));
+        fb.set(fields[0], id);
+        fb.set(fields[2], (unsigned char)delta);
+        fb.link(fields[1], add_record_batch(fb, node.length, &node, 1, buffers, buffer_count));
+        write_message(fb.data(), buffers, buffer_count);
+    }
+
+    void arrow_stream::write_batch(long long length, const arrow_node* nodes, size_t node_count,
+                                   const arrow_buffer* buffers, size_t buffer_count)
+    {
+        flatbuffer_builder fb;
+        size_t header = add_message(fb, header_record_batch, body_length(buffers, buffer_count));
+        fb.link(header, add_record_batch(fb, length, nodes, node_count, buffers, buffer_count));
+        write_message(fb.data(), buffers, buffer_count);
+    }
+}
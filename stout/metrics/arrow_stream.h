@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include "file_writer.h"
+
+namespace metrics
+{
+    /// types of values in arrow_stream columns
+    enum arrow_type
+    {
+        arrow_int8,
+        arrow_int32,
+        arrow_int64,
+        arrow_float64,
+        arrow_utf8,
+        arrow_timestamp_ms  ///< int64 milliseconds since 1970-01-01 UTC
+    };
+
+    /// column of the schema of an arrow_stream
+    struct arrow_field
+    {
+        const char* name;
+        arrow_type type;            ///< type of values, or of dictionary values
+        bool nullable;
+        long long dictionary;       ///< id of the dictionary of values, or -1 if not dictionary-encoded
+        arrow_type index_type;      ///< type of dictionary indices, arrow_int8 to arrow_int64
+
+        arrow_field(const char* name, arrow_type type, bool nullable = false) :
+            name(name), type(type), nullable(nullable), dictionary(-1), index_type(arrow_int32) { ; }
+        arrow_field(const char* name, arrow_type type, long long dictionary, arrow_type index_type) :
+            name(name), type(type), nullable(false), dictionary(dictionary), index_type(index_type) { ; }
+    };
+
+    /// length and number of nulls of a column in a batch, see arrow_stream
+    struct arrow_node
+    {
+        long long length;
+        long long null_count;
+    };
+
+    /// a buffer of a column in a batch, see arrow_stream
+    struct arrow_buffer
+    {
+        const void* data;
+        size_t size;                ///< in bytes, 0 for an omitted validity bitmap
+    };
+
+    /**
+    * Writes messages of the Apache Arrow IPC streaming format to a
+    * file_writer: the schema, then dictionary and record batches. Each
+    * column of a batch is given by an arrow_node and its buffers in the
+    * order Arrow defines, i.e. validity bitmap and values for fixed size
+    * types, validity bitmap, int32 offsets and characters for utf8. Buffers
+    * are written as they are, padded to 8 bytes, so the file can be
+    * memory-mapped and read without copying, e.g. by
+    * `pyarrow.ipc.open_stream(pyarrow.memory_map(path))`.
+    *
+    * Only little-endian layout is written. The writer doesn't keep track
+    * of the messages, e.g. that the schema comes first. No end of stream
+    * marker is written, so a stream can be read while it grows, and readers
+    * stop at the end of the file.
+    */
+    class arrow_stream
+    {
+        file_writer& m_out;
+
+        void write_message(const std::vector<char>& metadata, const arrow_buffer* buffers, size_t buffer_count);
+
+    public:
+        explicit arrow_stream(file_writer& out) : m_out(out) { ; }
+
+        /// writes the schema, which starts the stream
+        void write_schema(const arrow_field* fields, size_t count);
+
+        /**
+        * Writes a dictionary batch with a single utf8 column.
+        * @param id id of the dictionary, see arrow_field
+        * @param delta if true, values are appended to the dictionary, otherwise they replace it
+        */
+        void write_dictionary(long long id, bool delta, const arrow_node& node, const arrow_buffer* buffers, size_t buffer_count);
+
+        /// writes a record batch with `length` rows, a node per column of the schema
+        void write_batch(long long length, const arrow_node* nodes, size_t node_count,
+                         const arrow_buffer* buffers, size_t buffer_count);
+
+    private:
+        arrow_stream(const arrow_stream&);
+        arrow_stream& operator=(const arrow_stream&);
+    };
+}
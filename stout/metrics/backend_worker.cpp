@@ -0,0 +1,110 @@
+#include "stdafx.h"
+#include "backend_worker.h"
+#include <climits>
+
+namespace metrics
+{
+    backend_worker::backend_worker(const backend_entry& backend) :
+        m_backend(backend),
+        m_ready(CreateEvent(NULL, FALSE, FALSE, NULL)),
+        m_thread(NULL),
+        m_stop(0)
+    {
+        if (!m_ready) {
+            dbg_print("cannot create event for backend %s, error: %d", backend.options.name.c_str(), GetLastError());
+            return;
+        }
+
+        m_thread = CreateThread(NULL, 0, worker_proc, this, 0, NULL);
+        if (!m_thread) {
+            dbg_print("cannot start thread for backend %s, error: %d", backend.options.name.c_str(), GetLastError());
+        }
+    }
+
+    backend_worker::~backend_worker()
+    {
+        if (m_thread) {
+            InterlockedExchange(&m_stop, 1);
+            SetEvent(m_ready);
+            WaitForSingleObject(m_thread, INFINITE);
+            CloseHandle(m_thread);
+        }
+        if (m_ready) CloseHandle(m_ready);
+    }
+
+    DWORD WINAPI backend_worker::worker_proc(LPVOID params)
+    {
+        backend_worker* worker = static_cast<backend_worker*>(params);
+        while (WaitForSingleObject(worker->m_ready, INFINITE) == WAIT_OBJECT_0) {
+            while (true) {
+                std::shared_ptr<const stats> snapshot;
+                {
+                    scoped_lock lock(worker->m_lock);
+                    if (worker->m_queue.empty()) break;
+                    snapshot = worker->m_queue.front();
+                    worker->m_queue.pop_front();
+                }
+                worker->call(*snapshot);
+            }
+            if (worker->m_stop) break; // queue is drained at this point
+        }
+        return 0;
+    }
+
+    void backend_worker::call(const stats& snapshot)
+    {
+        const backend_options& options = m_backend.options;
+        auto start = timer::now();
+        bool failed = false;
+        try {
+            m_backend.fn(snapshot);
+        }
+        catch (const std::exception& e) {
+            dbg_print("backend %s failed: %s", options.name.c_str(), e.what());
+            failed = true;
+        }
+        catch (...) {
+            dbg_print("backend %s failed", options.name.c_str());
+            failed = true;
+        }
+        long long us = timer::to_us(timer::since(start));
+
+        scoped_lock lock(m_lock);
+        m_counters.durations_us.push_back(us > INT_MAX ? INT_MAX : (int)us);
+        if (failed) ++m_counters.failed;
+        if (options.slow_ms && us > options.slow_ms * 1000LL) {
+            dbg_print("backend %s took %lld us", options.name.c_str(), us);
+            ++m_counters.slow;
+        }
+    }
+
+    void backend_worker::post(const std::shared_ptr<const stats>& snapshot)
+    {
+        if (!m_thread) {
+            call(*snapshot);
+            return;
+        }
+
+        {
+            scoped_lock lock(m_lock);
+            if (m_queue.size() >= m_backend.options.queue_size) {
+                ++m_counters.dropped;
+                if (m_backend.options.overflow == drop_newest) return;
+                m_queue.pop_front();
+            }
+            m_queue.push_back(snapshot);
+        }
+        SetEvent(m_ready);
+    }
+
+    void backend_worker::take_counters(counters& out)
+    {
+        out.durations_us.clear();
+        scoped_lock lock(m_lock);
+        out.durations_us.swap(m_counters.durations_us); // buffers are exchanged, not reallocated
+        out.dropped = m_counters.dropped;
+        out.failed = m_counters.failed;
+        out.slow = m_counters.slow;
+        m_counters.dropped = m_counters.failed = m_counters.slow = 0;
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include "metrics_server.h"
+#include "sync.h"
+
+namespace metrics
+{
+    /**
+    * Calls a single backend on its own thread. Snapshots are queued by the
+    * flush thread and shared by all backends, so posting doesn't copy them.
+    * When the queue is full, a snapshot is dropped according to the
+    * backend's overflow policy.
+    */
+    class backend_worker
+    {
+    public:
+        /// backend activity since the counters were last taken
+        struct counters
+        {
+            std::vector<int> durations_us;  ///< duration of each call
+            unsigned int dropped;           ///< snapshots dropped because queue was full
+            unsigned int failed;            ///< calls which threw an exception
+            unsigned int slow;              ///< calls which took longer than slow_ms
+
+            counters() : dropped(0), failed(0), slow(0) { ; }
+        };
+
+    private:
+        backend_entry m_backend;
+        critical_section m_lock;        // guards queue and counters
+        std::deque<std::shared_ptr<const stats> > m_queue;
+        counters m_counters;
+        HANDLE m_ready;                 // set when a snapshot is queued or worker should stop
+        HANDLE m_thread;
+        volatile LONG m_stop;
+
+        static DWORD WINAPI worker_proc(LPVOID params);
+        void call(const stats& snapshot);
+
+    public:
+        explicit backend_worker(const backend_entry& backend);
+
+        /// delivers snapshots which are still queued and stops the thread
+        ~backend_worker();
+
+        const backend_options& options() const { return m_backend.options; }
+
+        /// queues the snapshot for the backend. if the worker thread could
+        /// not be started, the backend is called right away
+        void post(const std::shared_ptr<const stats>& snapshot);
+
+        /// moves counters collected since the last call to `out`
+        void take_counters(counters& out);
+
+    private:
+        backend_worker(const backend_worker&);
+        backend_worker& operator=(const backend_worker&);
+    };
+}
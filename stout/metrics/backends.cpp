@@ -1,8 +1,9 @@
 #include "stdafx.h"
 #include "backends.h"
 #include "metrics_server.h"
-#include <fstream> 
 #include <ctime>
+#include <float.h>
+#include <math.h>
 #include <string>
 #include <sstream>
 #include <iomanip>
@@ -12,80 +13,195 @@ namespace metrics
 {
     void console_backend::operator()(const stats& stats)
     {
-        FOR_EACH (auto& c, stats.counters)
+        const counter_columns& c = stats.counters;
+        for (size_t i = 0; i < c.size(); ++i)
         {
-            printf(" C: %s - %.2f 1/s\n", c.first.c_str(), c.second);
+            printf(" C: %s - %.2f 1/s\n", stats.name(c.series[i]), c.values[i]);
         }
-        FOR_EACH (auto& g, stats.gauges)
+        const gauge_columns& g = stats.gauges;
+        for (size_t i = 0; i < g.size(); ++i)
         {
-            printf(" G: %s - %lld\n", g.first.c_str(), g.second);
+            printf(" G: %s - %lld\n", stats.name(g.series[i]), g.values[i]);
         }
-        FOR_EACH (auto& t, stats.timers)
+        for (size_t i = 0; i < stats.timers.size(); ++i)
         {
-            printf(" H: %s\n", t.second.dump().c_str());
+            printf(" H: %s\n", stats.timer_row(i).dump().c_str());
         }
     }
 
     void file_backend::operator()(const stats& stats)
     {
-        std::ofstream ofs;
-        ofs.open(m_filename, std::ofstream::out | std::ofstream::app);
+        file_writer& out = *m_writer;
 
-        ofs << "@ TS: " << timer::to_string(stats.timestamp) << "\n";
+        out.write("@ TS: ");
+        out.write(timer::to_string(stats.timestamp));
+        out.write("\n");
 
-        FOR_EACH (auto& c, stats.counters)
+        const counter_columns& c = stats.counters;
+        for (size_t i = 0; i < c.size(); ++i)
         {
-            ofs << " C: " << c.first.c_str() << " - " << c.second << "1/s\n";
+            out.write(" C: ");
+            out.write(stats.name(c.series[i]));
+            out.format(" - %g1/s\n", c.values[i]);
         }
-        FOR_EACH (auto& g, stats.gauges)
+        const gauge_columns& g = stats.gauges;
+        for (size_t i = 0; i < g.size(); ++i)
         {
-            ofs << " G: " << g.first.c_str() << " - " << g.second << "\n";
+            out.write(" G: ");
+            out.write(stats.name(g.series[i]));
+            out.format(" - %lld\n", g.values[i]);
         }
-        FOR_EACH (auto& t, stats.timers)
+        for (size_t i = 0; i < stats.timers.size(); ++i)
         {
-            ofs << " H: " << t.second.dump() << "\n";
+            out.write(" H: ");
+            out.write(stats.timer_row(i).dump());
+            out.write("\n");
         }
-        ofs << "----------------------------------------------\n";
+        out.write("----------------------------------------------\n");
 
-        ofs.close();
+        out.commit();
     }
 
+	// formats integer without going through printf, returns the length
+	static size_t format_int(char* buffer, long long value)
+	{
+		char digits[24];
+		char* p = digits + sizeof(digits);
+		unsigned long long u = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+		do {
+			*--p = (char)('0' + u % 10);
+			u /= 10;
+		} while (u);
+		if (value < 0) *--p = '-';
+
+		size_t len = digits + sizeof(digits) - p;
+		memcpy(buffer, p, len);
+		return len;
+	}
+
+	static void write_int(file_writer& out, long long value)
+	{
+		char buffer[24];
+		out.write(buffer, format_int(buffer, value));
+	}
+
+	static size_t format_double(char* buffer, size_t size, double value);
+
 	void json_file_backend::operator()(const stats& stats)
 	{
-		const char indent[] = "    ";
-		std::ofstream ofs;
-		ofs.open(m_filename, std::ofstream::out | std::ofstream::app);
+		if (m_format == json_lines) write_lines(stats);
+		else write_pretty(stats);
+	}
 
-		int current_line = 0;
+	void json_file_backend::write_pretty(const stats& stats)
+	{
+		const char indent[] = ",\n    ";
+		file_writer& out = m_state->writer;
 
-		ofs << "{\n";
+		out.write("{\n    ");
+		out.write(to_quoted_string("_timestamp"));
+		out.write(": ");
+		out.write(to_quoted_string(timer::to_string(stats.timestamp).c_str()));
 
-		ofs << indent << to_quoted_string("_timestamp") << ": " << to_quoted_string(timer::to_string(stats.timestamp).c_str());
+		const counter_columns& c = stats.counters;
+		for (size_t i = 0; i < c.size(); ++i)
+		{
+			out.write(indent);
+			out.write(quoted_name(stats, c.series[i]));
+			out.write(": ");
+			out.write(double_to_string(c.values[i]));
+		}
+		const gauge_columns& g = stats.gauges;
+		for (size_t i = 0; i < g.size(); ++i)
+		{
+			out.write(indent);
+			out.write(quoted_name(stats, g.series[i]));
+			out.write(": ");
+			write_int(out, g.values[i]);
+		}
 
-		FOR_EACH(auto& c, stats.counters)
+		const timer_columns& t = stats.timers;
+		for (size_t i = 0; i < t.size(); ++i)
 		{
-			ofs << ",\n" << indent << to_quoted_string(c.first.c_str()) << ": " << double_to_string(c.second);
-}
-		FOR_EACH(auto& g, stats.gauges)
+			out.write(indent);
+			out.write(quoted_name(stats, t.series[i]));
+			out.write(": { \"avg\": ");
+			out.write(double_to_string(t.avg[i]));
+			out.format(", \"count\": %d, \"min\": ", t.count[i]);
+			out.write(double_to_string(t.min[i]));
+			out.write(", \"max\": ");
+			out.write(double_to_string(t.max[i]));
+			out.write(", \"stddev\": ");
+			out.write(double_to_string(t.stddev[i]));
+			out.format(", \"p50\": %d, \"p90\": %d, \"p99\": %d, \"p999\": %d }", t.p50[i], t.p90[i], t.p99[i], t.p999[i]);
+		}
+
+		out.write("\n}\n");
+		out.commit();
+	}
+
+	void json_file_backend::write_lines(const stats& stats)
+	{
+		file_writer& out = m_state->writer;
+		char number[32];
+
+		out.write("{\"_timestamp\":\"");
+		out.write(timer::to_string(stats.timestamp)); // digits and separators only
+		out.write("\"");
+
+		const counter_columns& c = stats.counters;
+		for (size_t i = 0; i < c.size(); ++i)
+		{
+			out.write(",");
+			out.write(quoted_name(stats, c.series[i]));
+			out.write(":");
+			out.write(number, format_double(number, sizeof(number), c.values[i]));
+		}
+		const gauge_columns& g = stats.gauges;
+		for (size_t i = 0; i < g.size(); ++i)
 		{
-			ofs << ",\n" << indent << to_quoted_string(g.first.c_str()) << ": " << g.second;
+			out.write(",");
+			out.write(quoted_name(stats, g.series[i]));
+			out.write(":");
+			write_int(out, g.values[i]);
 		}
 
-		FOR_EACH(auto& t, stats.timers)
+		const timer_columns& t = stats.timers;
+		for (size_t i = 0; i < t.size(); ++i)
 		{
-			ofs << ",\n" << indent << to_quoted_string(t.first.c_str()) << ": ";
-			ofs << "{ ";
-			ofs << to_quoted_string("avg") << ": " << double_to_string(t.second.avg) << ", ";
-			ofs << to_quoted_string("count") << ": " << t.second.count << ", ";
-			ofs << to_quoted_string("min") << ": " << double_to_string(t.second.min) << ", ";
-			ofs << to_quoted_string("max") << ": " << double_to_string(t.second.max) << ", ";
-			ofs << to_quoted_string("stddev") << ": " << double_to_string(t.second.stddev);
-			ofs << " }";
+			out.write(",");
+			out.write(quoted_name(stats, t.series[i]));
+			out.write(":{\"avg\":");
+			out.write(number, format_double(number, sizeof(number), t.avg[i]));
+			out.write(",\"count\":");
+			write_int(out, t.count[i]);
+			out.write(",\"min\":");
+			write_int(out, t.min[i]);
+			out.write(",\"max\":");
+			write_int(out, t.max[i]);
+			out.write(",\"stddev\":");
+			out.write(number, format_double(number, sizeof(number), t.stddev[i]));
+			out.write(",\"p50\":");
+			write_int(out, t.p50[i]);
+			out.write(",\"p90\":");
+			write_int(out, t.p90[i]);
+			out.write(",\"p99\":");
+			write_int(out, t.p99[i]);
+			out.write(",\"p999\":");
+			write_int(out, t.p999[i]);
+			out.write("}");
 		}
 
-		ofs << "\n}\n";
+		out.write("}\n");
+		out.commit();
+	}
 
-		ofs.close();
+	const std::string& json_file_backend::quoted_name(const stats& stats, unsigned int series)
+	{
+		std::vector<std::string>& names = m_state->names;
+		if (series >= names.size()) names.resize(stats.names->size());
+		if (names[series].empty()) names[series] = to_quoted_string(stats.name(series));
+		return names[series];
 	}
 
 	std::string json_file_backend::to_quoted_string(const char *value)
@@ -199,4 +315,411 @@ namespace metrics
 		return buffer;	
 	}
 
+	// formats significant digits d1.d2d3... * 10^exp like printf's %g does,
+	// without trailing zeros. returns the length
+	static size_t format_digits(char* buffer, bool negative, const char* digits, int count, int exp)
+	{
+		while (count > 1 && digits[count - 1] == '0') --count;
+
+		char* p = buffer;
+		if (negative) *p++ = '-';
+		if (exp < -5 || exp > 16) {
+			*p++ = digits[0];
+			if (count > 1) {
+				*p++ = '.';
+				memcpy(p, digits + 1, count - 1);
+				p += count - 1;
+			}
+			*p++ = 'e';
+			*p++ = exp < 0 ? '-' : '+';
+			int e = exp < 0 ? -exp : exp;
+			if (e < 10) *p++ = '0';
+			p += format_int(p, e);
+		}
+		else if (exp < 0) {
+			*p++ = '0';
+			*p++ = '.';
+			for (int i = -1; i > exp; --i) *p++ = '0';
+			memcpy(p, digits, count);
+			p += count;
+		}
+		else {
+			for (int i = 0; i <= exp; ++i) *p++ = i < count ? digits[i] : '0';
+			if (count > exp + 1) {
+				*p++ = '.';
+				memcpy(p, digits + exp + 1, count - exp - 1);
+				p += count - exp - 1;
+			}
+		}
+		*p = 0;
+		return p - buffer;
+	}
+
+	// formats the value with as few digits as are needed to read it back
+	// exactly. returns the length
+	static size_t format_double(char* buffer, size_t size, double value)
+	{
+		if (!_finite(value)) { // JSON has no NaN or infinity
+			strcpy_s(buffer, size, "null");
+			return 4;
+		}
+		if (value == floor(value) && fabs(value) < 1e15) return format_int(buffer, (long long)value);
+
+		// fast path for values with few decimals, e.g. rates and averages of
+		// small counts. both m and 10^k are exact, so if m / 10^k gives the
+		// value back, parsing the decimal string does as well
+		const double scales[] = { 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+		if (fabs(value) < 1e9) {
+			for (int k = 0; k < 6; ++k) {
+				double m = floor(value * scales[k] + 0.5);
+				if (m / scales[k] != value) continue;
+
+				long long digits = (long long)fabs(m);
+				long long whole = digits / (long long)scales[k];
+				char* p = buffer;
+				if (value < 0) *p++ = '-';
+				p += format_int(p, whole);
+				*p++ = '.';
+				size_t decimals = format_int(p, digits - whole * (long long)scales[k]);
+				size_t zeros = k + 1 - decimals; // leading zeros of the fraction
+				memmove(p + zeros, p, decimals);
+				memset(p, '0', zeros);
+				p += k + 1;
+				*p = 0;
+				return p - buffer;
+			}
+		}
+
+		// 17 significant digits always read back exactly. shorter candidates
+		// are rounded from them and checked by parsing
+		char sci[32]; // d.dddddddddddddddde+XX
+		_snprintf_s(sci, sizeof(sci), _TRUNCATE, "%.16e", fabs(value));
+		char digits[17];
+		digits[0] = sci[0];
+		memcpy(digits + 1, sci + 2, 16);
+		int exp = atoi(sci + 19);
+
+		for (int count = 15; count < 17; ++count) {
+			char rounded[17];
+			int rounded_exp = exp;
+			memcpy(rounded, digits, count);
+			if (digits[count] >= '5') {
+				int i = count - 1;
+				while (i >= 0 && rounded[i] == '9') rounded[i--] = '0';
+				if (i >= 0) ++rounded[i];
+				else {
+					rounded[0] = '1'; // 99..9 became 100..0
+					++rounded_exp;
+				}
+			}
+			size_t len = format_digits(buffer, value < 0, rounded, count, rounded_exp);
+			if (strtod(buffer, NULL) == value) return len;
+
+			// a trailing 5 may itself be rounded up, so the value can be below the midpoint
+			if (count == 16 && digits[16] == '5') {
+				len = format_digits(buffer, value < 0, digits, 16, exp);
+				if (strtod(buffer, NULL) == value) return len;
+			}
+		}
+		return format_digits(buffer, value < 0, digits, 17, exp);
+	}
+
+	// CSV has no notation for NaN or infinity, so such values are left empty
+	static void write_double(file_writer& out, double value)
+	{
+		if (!_finite(value)) return;
+		char buffer[32];
+		out.write(buffer, format_double(buffer, sizeof(buffer), value));
+	}
+
+	static const size_t no_position = series_columns::npos; // of a series without row or column group
+
+	static const char* const timer_stats[] = {
+		".count", ".avg", ".min", ".max", ".sum", ".stddev", ".p50", ".p90", ".p99", ".p999"
+	};
+
+	void csv_backend::operator()(const stats& stats)
+	{
+		state& st = *m_state;
+		if (!st.started) {
+			st.writer.start_new(); // rows of a previous run may have other columns
+			st.started = true;
+		}
+		else if (st.writer.failures() != st.failures) {
+			st.writer.start_new(); // the last row may be cut
+		}
+		st.failures = st.writer.failures();
+
+		st.rows.assign(st.groups.size(), no_position);
+		map_rows(counter_column, stats.counters);
+		map_rows(gauge_column, stats.gauges);
+		map_rows(timer_column, stats.timers);
+
+		// rows only have the columns of the header in the file, so if the
+		// header can't be rewritten, new columns are left out until it can
+		if (st.writer.at_start()) {
+			st.writer.write(header(stats));
+			st.header_groups = st.groups.size();
+		}
+		else if (st.header_groups < st.groups.size() && st.rewrite_wait-- == 0) {
+			if (st.writer.replace_first_line(header(stats))) {
+				st.header_groups = st.groups.size();
+				st.rewrite_backoff = 0;
+			}
+			else { // retried after 1, 2, 4 ... 64 flushes
+				st.rewrite_wait = st.rewrite_backoff;
+				st.rewrite_backoff = st.rewrite_backoff ? (st.rewrite_backoff < 64 ? st.rewrite_backoff * 2 : 64) : 1;
+			}
+		}
+
+		write_row(stats);
+		st.writer.commit();
+	}
+
+	// finds the group of columns of each row, new series get a group at the end
+	void csv_backend::map_rows(column_kind kind, const series_columns& columns)
+	{
+		state& st = *m_state;
+		std::vector<size_t>& positions = st.positions[kind];
+		for (size_t row = 0; row < columns.size(); ++row)
+		{
+			unsigned int series = columns.series[row];
+			if (series >= positions.size()) positions.resize(series + 1, no_position);
+			if (positions[series] == no_position) {
+				positions[series] = st.groups.size();
+				column_group group = { kind, series };
+				st.groups.push_back(group);
+				st.rows.push_back(no_position);
+			}
+			st.rows[positions[series]] = row;
+		}
+	}
+
+	std::string csv_backend::header(const stats& stats) const
+	{
+		std::string line = "timestamp";
+		const std::vector<column_group>& groups = m_state->groups;
+		for (size_t i = 0; i < groups.size(); ++i)
+		{
+			const char* name = stats.name(groups[i].series);
+			if (groups[i].kind != timer_column) {
+				add_quoted(line, name, "");
+				continue;
+			}
+			for (size_t k = 0; k < _countof(timer_stats); ++k) add_quoted(line, name, timer_stats[k]);
+		}
+		line += "\n";
+		return line;
+	}
+
+	// appends a cell with the name, quoted if it contains a separator
+	void csv_backend::add_quoted(std::string& line, const char* name, const char* suffix)
+	{
+		line += ",";
+		if (strpbrk(name, ",\"\r\n") == NULL) {
+			line += name;
+			line += suffix;
+			return;
+		}
+
+		line += "\"";
+		for (const char* c = name; *c != 0; ++c)
+		{
+			if (*c == '"') line += "\"";
+			line += *c;
+		}
+		line += suffix;
+		line += "\"";
+	}
+
+	void csv_backend::write_row(const stats& stats)
+	{
+		file_writer& out = m_state->writer;
+		const std::vector<column_group>& groups = m_state->groups;
+		const std::vector<size_t>& rows = m_state->rows;
+
+		out.write(timer::to_string(stats.timestamp)); // no separators to quote
+		for (size_t i = 0; i < m_state->header_groups; ++i)
+		{
+			size_t row = rows[i];
+			out.write(",");
+			if (row == no_position) {
+				if (groups[i].kind == timer_column) out.write(",,,,,,,,,"); // rest of the empty cells
+				continue;
+			}
+
+			if (groups[i].kind == counter_column) {
+				write_double(out, stats.counters.values[row]);
+			}
+			else if (groups[i].kind == gauge_column) {
+				write_int(out, stats.gauges.values[row]);
+			}
+			else {
+				const timer_columns& t = stats.timers;
+				write_int(out, t.count[row]);
+				out.write(",");
+				write_double(out, t.avg[row]);
+				out.write(",");
+				write_int(out, t.min[row]);
+				out.write(",");
+				write_int(out, t.max[row]);
+				out.write(",");
+				write_int(out, t.sum[row]);
+				out.write(",");
+				write_double(out, t.stddev[row]);
+				out.write(",");
+				write_int(out, t.p50[row]);
+				out.write(",");
+				write_int(out, t.p90[row]);
+				out.write(",");
+				write_int(out, t.p99[row]);
+				out.write(",");
+				write_int(out, t.p999[row]);
+			}
+		}
+		out.write("\n");
+	}
+
+	static const arrow_field arrow_fields[] = {
+		arrow_field("timestamp", arrow_timestamp_ms),
+		arrow_field("name", arrow_utf8, 0, arrow_int32),
+		arrow_field("kind", arrow_utf8, 1, arrow_int8),
+		arrow_field("value", arrow_float64),
+		arrow_field("count", arrow_int32, true),
+		arrow_field("min", arrow_int32, true),
+		arrow_field("max", arrow_int32, true),
+		arrow_field("sum", arrow_int64, true),
+		arrow_field("stddev", arrow_float64, true),
+		arrow_field("p50", arrow_int32, true),
+		arrow_field("p90", arrow_int32, true),
+		arrow_field("p99", arrow_int32, true),
+		arrow_field("p999", arrow_int32, true)
+	};
+	static const size_t arrow_columns = _countof(arrow_fields);
+
+	// dictionary of the kind column, indices match the order of rows
+	static const int kind_offsets[] = { 0, 7, 12, 17 };
+	static const char kind_chars[] = "countergaugetimer";
+
+	void arrow_backend::operator()(const stats& stats)
+	{
+		state& st = *m_state;
+		if (!st.started) {
+			st.writer.start_new(); // a stream has a single schema, at its start
+			st.started = true;
+		}
+		else if (st.writer.failures() != st.failures) {
+			// messages after a lost one can't be read, and names in the
+			// lost dictionary deltas are missing, so a new stream is due
+			st.writer.start_new();
+			if (!st.writer.at_start()) {
+				dbg_print("cannot start a new stream, stats are dropped");
+				return; // retried on next flush
+			}
+		}
+		st.failures = st.writer.failures();
+
+		bool start = st.writer.at_start();
+		if (start) {
+			st.stream.write_schema(arrow_fields, arrow_columns);
+			arrow_node node = { 3, 0 };
+			arrow_buffer buffers[] = { { NULL, 0 }, { kind_offsets, sizeof(kind_offsets) }, { kind_chars, kind_offsets[3] } };
+			st.stream.write_dictionary(1, false, node, buffers, _countof(buffers));
+			st.names_written = 0;
+		}
+		write_names(stats, !start);
+		write_batch(stats);
+		st.writer.commit();
+	}
+
+	// writes names added since the last flush, or all of them to a new file
+	void arrow_backend::write_names(const stats& stats, bool delta)
+	{
+		state& st = *m_state;
+		unsigned int count = stats.names->size();
+		if (delta && count <= st.names_written) return;
+
+		st.name_offsets.assign(1, 0);
+		st.name_chars.clear();
+		for (unsigned int id = st.names_written; id < count; ++id)
+		{
+			st.name_chars += stats.name(id);
+			st.name_offsets.push_back((int)st.name_chars.size());
+		}
+
+		arrow_node node = { count - st.names_written, 0 };
+		arrow_buffer buffers[] = {
+			{ NULL, 0 },
+			{ &st.name_offsets[0], st.name_offsets.size() * sizeof(int) },
+			{ st.name_chars.data(), st.name_chars.size() }
+		};
+		st.stream.write_dictionary(0, delta, node, buffers, _countof(buffers));
+		st.names_written = count;
+	}
+
+	template <typename T>
+	static arrow_buffer to_buffer(const std::vector<T>& column)
+	{
+		arrow_buffer buffer = { column.empty() ? NULL : &column[0], column.size() * sizeof(T) };
+		return buffer;
+	}
+
+	// statistics of timers follow null cells of other kinds of series
+	template <typename T>
+	static arrow_buffer timer_column(std::vector<T>& column, size_t nulls, const std::vector<T>& values)
+	{
+		column.assign(nulls, T());
+		column.insert(column.end(), values.begin(), values.end());
+		return to_buffer(column);
+	}
+
+	void arrow_backend::write_batch(const stats& stats)
+	{
+		state& st = *m_state;
+		const counter_columns& c = stats.counters;
+		const gauge_columns& g = stats.gauges;
+		const timer_columns& t = stats.timers;
+		size_t nulls = c.size() + g.size();
+		size_t rows = nulls + t.size();
+
+		st.timestamps.assign(rows, timer::to_unix_ms(stats.timestamp));
+		st.names.clear();
+		st.names.insert(st.names.end(), c.series.begin(), c.series.end());
+		st.names.insert(st.names.end(), g.series.begin(), g.series.end());
+		st.names.insert(st.names.end(), t.series.begin(), t.series.end());
+		st.kinds.assign(c.size(), 0);
+		st.kinds.resize(nulls, 1);
+		st.kinds.resize(rows, 2);
+		st.values.assign(c.values.begin(), c.values.end());
+		st.values.insert(st.values.end(), g.values.begin(), g.values.end());
+		st.values.insert(st.values.end(), t.avg.begin(), t.avg.end());
+
+		st.validity.assign((rows + 7) / 8, 0);
+		for (size_t i = nulls; i < rows; ++i) st.validity[i / 8] |= (unsigned char)(1 << (i % 8));
+
+		arrow_node nodes[arrow_columns];
+		for (size_t i = 0; i < arrow_columns; ++i) {
+			nodes[i].length = rows;
+			nodes[i].null_count = arrow_fields[i].nullable ? nulls : 0;
+		}
+
+		const arrow_buffer none = { NULL, 0 };
+		arrow_buffer valid = nulls ? to_buffer(st.validity) : none;
+		arrow_buffer buffers[] = {
+			none, to_buffer(st.timestamps),
+			none, to_buffer(st.names),
+			none, to_buffer(st.kinds),
+			none, to_buffer(st.values),
+			valid, timer_column(st.count, nulls, t.count),
+			valid, timer_column(st.minimum, nulls, t.min),
+			valid, timer_column(st.maximum, nulls, t.max),
+			valid, timer_column(st.sum, nulls, t.sum),
+			valid, timer_column(st.stddev, nulls, t.stddev),
+			valid, timer_column(st.p50, nulls, t.p50),
+			valid, timer_column(st.p90, nulls, t.p90),
+			valid, timer_column(st.p99, nulls, t.p99),
+			valid, timer_column(st.p999, nulls, t.p999)
+		};
+		st.stream.write_batch(rows, nodes, arrow_columns, buffers, _countof(buffers));
+	}
 }
@@ -1,10 +1,15 @@
 #pragma once
 
 #include <string>
+#include <memory>
+#include <vector>
+#include "file_writer.h"
+#include "arrow_stream.h"
 
 namespace metrics
 {
     struct stats;
+    struct series_columns;
 
     /// Simple backend to dump stats to console
     class console_backend
@@ -20,13 +25,16 @@ namespace metrics
     /// Simple backend to dump stats to file
     class file_backend
     {
-        std::string m_filename;
+        std::shared_ptr<file_writer> m_writer; // shared by copies of the backend
     public:
         /**
-        * Creates an instance of file_backend
+        * Creates an instance of file_backend. The file is kept open while
+        * the backend exists.
         * @param filename name of the file where stats will be written
+        * @param options buffering, sync and rotation of the file
         */
-        file_backend(const char* filename) : m_filename(filename){ ; }
+        file_backend(const char* filename, const file_options& options = file_options()) :
+            m_writer(std::make_shared<file_writer>(filename, options)) { ; }
         /**
         * Dumps the provided statistics data to file
         * @param stats Statistic data resulting from last flush
@@ -34,27 +42,198 @@ namespace metrics
         void operator()(const stats& stats);
     };
 
-	/// Simple backend that dums stats to JSON file. 
+	/// layout of json_file_backend output
+	enum json_format
+	{
+		json_pretty,    ///< one indented object per flush
+		json_lines      ///< NDJSON, one object per flush on a single line
+	};
+
+	/**
+	* Simple backend that dums stats to JSON file. With json_lines format,
+	* the file is valid NDJSON and can be streamed to other tools.
+	*
+	* Escaped names are cached by series id, so an instance must be used
+	* by a single server.
+	*/
 	class json_file_backend
 	{
-		std::string m_filename;
+		// shared by copies of the backend
+		struct state
+		{
+			file_writer writer;
+			std::vector<std::string> names; // quoted and escaped, by series id
+
+			state(const char* filename, const file_options& options) : writer(filename, options) { ; }
+		};
+
+		std::shared_ptr<state> m_state;
+		json_format m_format;
 	public:
 		/**
-		* Creates an instance of json_file_backend
+		* Creates an instance of json_file_backend. The file is kept open
+		* while the backend exists.
 		* @param filename name of the file where stats will be written
+		* @param options buffering, sync and rotation of the file
+		* @param format pretty printed or NDJSON output
 		*/
-		json_file_backend(const char* filename) : m_filename(filename){ ; }
+		json_file_backend(const char* filename, const file_options& options = file_options(), json_format format = json_pretty) :
+			m_state(std::make_shared<state>(filename, options)), m_format(format) { ; }
 		/**
 		* Dumps the provided statistics data to file
 		* @param stats Statistic data resulting from last flush
 		*/
 		void operator()(const stats& stats);
 	private:
+		void write_pretty(const stats& stats);
+		void write_lines(const stats& stats);
+		const std::string& quoted_name(const stats& stats, unsigned int series);
 		std::string to_quoted_string(const char *value);
 		static bool contains_control_character(const char* str);
 		static bool is_control_character(char ch);
 		static std::string double_to_string(double value);
 	};
+
+	/**
+	* Backend that writes stats to a CSV file in wide format: one row per
+	* flush, starting with the timestamp, and one column per statistic of a
+	* series - the rate of a counter, the value of a gauge, and `count`,
+	* `avg`, `min`, `max`, `sum`, `stddev`, `p50`, `p90`, `p99` and `p999`
+	* of a timer, named e.g. `db.query.p99`.
+	*
+	* Columns keep their position for the whole run, and a series missing
+	* from a flush leaves its cells empty. When new series appear, their
+	* columns are appended and the header of the file is rewritten, which
+	* copies the file, so rows written before stay valid with fewer cells.
+	* Until the header is rewritten, e.g. while another process keeps the
+	* file open, rows leave the new columns out. A file left by a previous
+	* run is rotated away on the first flush, and each rotated file starts
+	* with its own header. If writing fails, a row may be cut, so the file
+	* is rotated and a new one is started.
+	*
+	* The layout is kept by series id, so an instance must be used by a
+	* single server.
+	*/
+	class csv_backend
+	{
+		enum column_kind { counter_column, gauge_column, timer_column, column_kinds };
+
+		struct column_group
+		{
+			column_kind kind;
+			unsigned int series;
+		};
+
+		// shared by copies of the backend
+		struct state
+		{
+			file_writer writer;
+			std::vector<column_group> groups;           // in order of the header
+			std::vector<size_t> positions[column_kinds];  // index of group by series id
+			std::vector<size_t> rows;                   // row of each group in current stats
+			size_t header_groups;                       // groups in the header of the file
+			unsigned int rewrite_wait;                  // flushes until the header is rewritten after a failure
+			unsigned int rewrite_backoff;               // next value of rewrite_wait
+			unsigned int failures;                      // of the writer, seen by the last flush
+			bool started;
+
+			state(const char* filename, const file_options& options) :
+				writer(filename, options), header_groups(0), rewrite_wait(0), rewrite_backoff(0), failures(0), started(false) { ; }
+		};
+
+		std::shared_ptr<state> m_state;
+	public:
+		/**
+		* Creates an instance of csv_backend. The file is kept open while
+		* the backend exists.
+		* @param filename name of the file where stats will be written
+		* @param options buffering, sync and rotation of the file
+		*/
+		csv_backend(const char* filename, const file_options& options = file_options()) :
+			m_state(std::make_shared<state>(filename, options)) { ; }
+		/**
+		* Writes a row with the provided statistics data to file
+		* @param stats Statistic data resulting from last flush
+		*/
+		void operator()(const stats& stats);
+	private:
+		void map_rows(column_kind kind, const series_columns& columns);
+		std::string header(const stats& stats) const;
+		void write_row(const stats& stats);
+		static void add_quoted(std::string& line, const char* name, const char* suffix);
+	};
+
+	/**
+	* Backend that appends stats to a file in Apache Arrow IPC streaming
+	* format, which pandas (pyarrow) or DuckDB load without parsing. Each
+	* flush is a record batch with a row per series and columns:
+	*
+	* - `timestamp`: time of the flush, timestamp[ms] in UTC
+	* - `name`: name of the series, dictionary-encoded, the int32 index is the series id
+	* - `kind`: `counter`, `gauge` or `timer`, dictionary-encoded
+	* - `value`: double, rate per second of a counter, value of a gauge or average of a timer
+	* - `count`, `min`, `max`, `sum`, `stddev`, `p50`, `p90`, `p99`, `p999`: statistics
+	*   of a timer, null for other kinds
+	*
+	* Names are written once per file, new ones as dictionary deltas. A file
+	* left by a previous run is rotated away on the first flush, and each
+	* rotated file is a complete stream with its own schema. If writing
+	* fails, the stream may end with a partial message and lack names, so
+	* the file is rotated and a new stream is started. All buffers are
+	* 8-byte aligned, so the file can be memory-mapped, e.g.
+	* ~~~{.py}
+	* table = pyarrow.ipc.open_stream(pyarrow.memory_map("stats.arrows")).read_all()
+	* ~~~
+	*
+	* The dictionary is kept by series id, so an instance must be used by a
+	* single server.
+	*/
+	class arrow_backend
+	{
+		// shared by copies of the backend
+		struct state
+		{
+			file_writer writer;
+			arrow_stream stream;
+			unsigned int names_written;     // in the dictionary of the current file
+			unsigned int failures;          // of the writer, seen by the last flush
+			bool started;
+
+			// columns of the last batch, kept to reuse memory
+			std::vector<long long> timestamps;
+			std::vector<int> names;
+			std::vector<signed char> kinds;
+			std::vector<double> values;
+			std::vector<unsigned char> validity; // of timer statistics
+			std::vector<int> count, minimum, maximum, p50, p90, p99, p999;
+			std::vector<long long> sum;
+			std::vector<double> stddev;
+			std::vector<int> name_offsets;
+			std::string name_chars;
+
+			state(const char* filename, const file_options& options) :
+				writer(filename, options), stream(writer), names_written(0), failures(0), started(false) { ; }
+		};
+
+		std::shared_ptr<state> m_state;
+	public:
+		/**
+		* Creates an instance of arrow_backend. The file is kept open while
+		* the backend exists.
+		* @param filename name of the file where stats will be written, `.arrows` is the usual extension
+		* @param options buffering, sync and rotation of the file
+		*/
+		arrow_backend(const char* filename, const file_options& options = file_options()) :
+			m_state(std::make_shared<state>(filename, options)) { ; }
+		/**
+		* Appends a record batch with the provided statistics data to file
+		* @param stats Statistic data resulting from last flush
+		*/
+		void operator()(const stats& stats);
+	private:
+		void write_names(const stats& stats, bool delta);
+		void write_batch(const stats& stats);
+	};
     /*
     class event_log_backend
     {
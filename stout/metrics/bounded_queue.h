@@ -0,0 +1,159 @@
+#pragma once
+
+#include "Winsock2.h"
+
+namespace metrics
+{
+    /**
+    * Bounded lock-free queue for multiple producers and a single consumer.
+    * Based on Dmitry Vyukov's bounded MPMC queue: each cell carries a sequence
+    * number which tells whether it is ready to be written or read, so
+    * producers only contend on a single interlocked increment.
+    *
+    * The whole queue state lives in a single memory block, which is either
+    * allocated by the queue or provided by the caller (e.g. shared memory),
+    * so T must be a POD type if the queue is shared between processes.
+    *
+    * Capacity is rounded up to the power of 2. T must be copyable.
+    */
+    template <typename T>
+    class bounded_queue
+    {
+        struct cell
+        {
+            volatile LONG sequence;
+            T data;
+        };
+
+        // placed at the start of the memory block, followed by the cells
+        struct header
+        {
+            ULONG mask;
+            char pad1[60];   // keep producer and consumer positions on separate cache lines
+            volatile LONG enqueue_pos;
+            char pad2[60];
+            volatile LONG dequeue_pos;
+            char pad3[60];
+        };
+
+        header* m_header;
+        cell* m_cells;
+        ULONG m_mask;       // copy of header mask, which another process could overwrite
+        char* m_owned;      // memory allocated by the queue, NULL if provided by caller
+
+        static LONG diff(LONG a, LONG b) { return (LONG)((ULONG)a - (ULONG)b); }
+
+        void init(void* memory, unsigned int capacity)
+        {
+            m_header = static_cast<header*>(memory);
+            m_cells = reinterpret_cast<cell*>(m_header + 1);
+
+            unsigned int size = round_capacity(capacity);
+            m_header->mask = m_mask = size - 1;
+            m_header->enqueue_pos = 0;
+            m_header->dequeue_pos = 0;
+            for (unsigned int i = 0; i < size; ++i) m_cells[i].sequence = (LONG)i;
+        }
+
+    public:
+        /// returns the capacity rounded up to the power of 2
+        static unsigned int round_capacity(unsigned int capacity)
+        {
+            unsigned int size = 2;
+            while (size < capacity) size <<= 1;
+            return size;
+        }
+
+        /// returns the size of the memory block needed for the queue
+        static size_t memory_size(unsigned int capacity)
+        {
+            return sizeof(header) + round_capacity(capacity) * sizeof(cell);
+        }
+
+        /// creates a queue in memory allocated by the queue itself
+        explicit bounded_queue(unsigned int capacity) : m_owned(new char[memory_size(capacity)])
+        {
+            init(m_owned, capacity);
+        }
+
+        /// creates a queue in memory provided by caller, which must be at
+        /// least memory_size(capacity) bytes long and outlive the queue
+        bounded_queue(void* memory, unsigned int capacity) : m_owned(NULL)
+        {
+            init(memory, capacity);
+        }
+
+        /// attaches to a queue which was already created in the memory block.
+        /// the capacity is read once, check it with capacity() before use
+        explicit bounded_queue(void* memory) : m_owned(NULL)
+        {
+            m_header = static_cast<header*>(memory);
+            m_cells = reinterpret_cast<cell*>(m_header + 1);
+            m_mask = m_header->mask;
+        }
+
+        ~bounded_queue() { delete[] m_owned; }
+
+        /// adds an item to the queue. returns `false` if the queue is full.
+        /// safe to call from multiple threads.
+        bool push(const T& data)
+        {
+            cell* c;
+            LONG pos = m_header->enqueue_pos;
+            while (true) {
+                c = &m_cells[pos & m_mask];
+                LONG d = diff(c->sequence, pos);
+                if (d == 0) {
+                    if (InterlockedCompareExchange(&m_header->enqueue_pos, pos + 1, pos) == pos) break;
+                }
+                else if (d < 0) {
+                    return false; // full
+                }
+                else {
+                    pos = m_header->enqueue_pos;
+                }
+            }
+
+            c->data = data;
+            InterlockedExchange(&c->sequence, pos + 1); // publish the cell
+            return true;
+        }
+
+        /// removes an item from the queue. returns `false` if the queue is
+        /// empty. must be called only from a single thread.
+        bool pop(T& data)
+        {
+            LONG pos = m_header->dequeue_pos;
+            cell* c = &m_cells[pos & m_mask];
+            if (diff(c->sequence, pos + 1) < 0) return false; // empty
+
+            data = c->data;
+            InterlockedExchange(&c->sequence, pos + (LONG)m_mask + 1); // release the cell for producers
+            m_header->dequeue_pos = pos + 1;
+            return true;
+        }
+
+        /// returns `true` if there is no item to pop, unlike size() it doesn't
+        /// count items which are still being pushed. must be called only from
+        /// the consumer thread
+        bool empty() const
+        {
+            LONG pos = m_header->dequeue_pos;
+            return diff(m_cells[pos & m_mask].sequence, pos + 1) < 0;
+        }
+
+        /// returns the approximate number of items in the queue
+        unsigned int size() const
+        {
+            LONG d = diff(m_header->enqueue_pos, m_header->dequeue_pos);
+            return d > 0 ? (unsigned int)d : 0;
+        }
+
+        /// returns the maximum number of items in the queue
+        unsigned int capacity() const { return m_mask + 1; }
+
+    private:
+        bounded_queue(const bounded_queue&);
+        bounded_queue& operator=(const bounded_queue&);
+    };
+}
@@ -0,0 +1,188 @@
+#include "stdafx.h"
+#include "file_writer.h"
+#include "metrics.h"
+#include <stdarg.h>
+
+namespace metrics
+{
+    file_writer::file_writer(const char* filename, const file_options& options) :
+        m_filename(filename),
+        m_options(options),
+        m_file(INVALID_HANDLE_VALUE),
+        m_size(0),
+        m_commits(0),
+        m_failures(0)
+    {
+        m_buffer.reserve(options.buffer_size);
+    }
+
+    file_writer::~file_writer()
+    {
+        write_buffer();
+        close();
+    }
+
+    bool file_writer::open()
+    {
+        if (m_file != INVALID_HANDLE_VALUE) return true;
+
+        m_file = CreateFile(m_filename.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                            NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            dbg_print("cannot open %s, error: %d", m_filename.c_str(), GetLastError());
+            return false;
+        }
+
+        LARGE_INTEGER size;
+        m_size = GetFileSizeEx(m_file, &size) ? size.QuadPart : 0;
+        return true;
+    }
+
+    void file_writer::close()
+    {
+        if (m_file == INVALID_HANDLE_VALUE) return;
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+
+    static bool write_all(HANDLE file, const char* data, size_t len)
+    {
+        while (len > 0) {
+            DWORD written = 0;
+            if (!WriteFile(file, data, (DWORD)len, &written, NULL)) return false;
+            data += written;
+            len -= written;
+        }
+        return true;
+    }
+
+    void file_writer::write_buffer()
+    {
+        if (m_buffer.empty()) return;
+        if (!open()) { // data is lost, but memory doesn't grow while file is unavailable
+            m_buffer.clear();
+            ++m_failures;
+            return;
+        }
+
+        if (write_all(m_file, &m_buffer[0], m_buffer.size())) {
+            m_size += m_buffer.size();
+        }
+        else {
+            dbg_print("cannot write to %s, error: %d", m_filename.c_str(), GetLastError());
+            close(); // reopened on next write
+            ++m_failures;
+        }
+        m_buffer.clear();
+    }
+
+    void file_writer::write(const char* data, size_t len)
+    {
+        if (m_buffer.size() + len > m_options.buffer_size) write_buffer();
+        m_buffer.insert(m_buffer.end(), data, data + len);
+    }
+
+    void file_writer::format(const char* fmt, ...)
+    {
+        char text[512];
+        va_list args;
+        va_start(args, fmt);
+        int len = _vsnprintf_s(text, _countof(text), _TRUNCATE, fmt, args);
+        va_end(args);
+        write(text, len < 0 ? strlen(text) : len);
+    }
+
+    void file_writer::commit()
+    {
+        write_buffer();
+        if (m_file == INVALID_HANDLE_VALUE) return;
+
+        if (m_options.sync_every && ++m_commits >= m_options.sync_every) {
+            FlushFileBuffers(m_file);
+            m_commits = 0;
+        }
+
+        if (m_options.rotate_size && m_size >= m_options.rotate_size) rotate();
+    }
+
+    bool file_writer::at_start()
+    {
+        if (!m_buffer.empty()) return false;
+        return !open() || m_size == 0;
+    }
+
+    void file_writer::start_new()
+    {
+        write_buffer();
+        if (open() && m_size > 0) rotate();
+    }
+
+    bool file_writer::replace_first_line(const std::string& line)
+    {
+        write_buffer();
+        if (at_start()) {
+            write(line);
+            return true;
+        }
+        close(); // reopened on next write
+
+        std::string temp = m_filename + ".tmp";
+        HANDLE in = CreateFile(m_filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        HANDLE out = CreateFile(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+        bool ok = in != INVALID_HANDLE_VALUE && out != INVALID_HANDLE_VALUE && write_all(out, line.data(), line.size());
+        bool skipping = true; // the old first line
+        std::vector<char> chunk(64 * 1024);
+        while (ok) {
+            DWORD read = 0;
+            ok = ReadFile(in, &chunk[0], (DWORD)chunk.size(), &read, NULL) != 0;
+            if (!ok || read == 0) break;
+
+            const char* data = &chunk[0];
+            const char* end = data + read;
+            if (skipping) {
+                const char* eol = (const char*)memchr(data, '\n', read);
+                if (eol == NULL) continue;
+                data = eol + 1;
+                skipping = false;
+            }
+            ok = write_all(out, data, end - data);
+        }
+        if (!ok) dbg_print("cannot rewrite %s, error: %d", m_filename.c_str(), GetLastError());
+
+        if (in != INVALID_HANDLE_VALUE) CloseHandle(in);
+        if (out != INVALID_HANDLE_VALUE) CloseHandle(out);
+
+        if (ok && !MoveFileEx(temp.c_str(), m_filename.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            dbg_print("cannot replace %s, error: %d", m_filename.c_str(), GetLastError());
+            ok = false;
+        }
+        if (!ok) DeleteFile(temp.c_str());
+        return ok;
+    }
+
+    // renames <file>.<n-1> to <file>.<n>, ..., <file> to <file>.1, and the
+    // oldest one is deleted. the new file is created on next write. the
+    // current file is always kept, so `rotate_keep` 0 works like 1
+    void file_writer::rotate()
+    {
+        if (m_options.sync_every) FlushFileBuffers(m_file);
+        close();
+        m_size = 0;
+
+        char from[MAX_PATH], to[MAX_PATH];
+        unsigned int keep = m_options.rotate_keep ? m_options.rotate_keep : 1;
+        sprintf_s(to, "%s.%u", m_filename.c_str(), keep);
+        DeleteFile(to);
+        for (unsigned int i = keep - 1; i > 0; --i) {
+            sprintf_s(from, "%s.%u", m_filename.c_str(), i);
+            sprintf_s(to, "%s.%u", m_filename.c_str(), i + 1);
+            MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING);
+        }
+        sprintf_s(to, "%s.1", m_filename.c_str());
+        if (!MoveFileEx(m_filename.c_str(), to, MOVEFILE_REPLACE_EXISTING)) {
+            dbg_print("cannot rotate %s, error: %d", m_filename.c_str(), GetLastError());
+        }
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include "Winsock2.h"
+
+namespace metrics
+{
+    /// settings of file output, see file_writer
+    struct file_options
+    {
+        size_t buffer_size;             ///< bytes collected before they are written to the file
+        unsigned int sync_every;        ///< commits between forcing data to disk, 0 leaves it to the OS
+        unsigned long long rotate_size; ///< file is rotated when it grows over this size, 0 turns rotation off
+        unsigned int rotate_keep;       ///< number of rotated files kept, named `<file>.1` (newest) to `<file>.<n>`, at least 1
+
+        explicit file_options(size_t buffer_size = 1024 * 1024, unsigned int sync_every = 0,
+                              unsigned long long rotate_size = 0, unsigned int rotate_keep = 5) :
+            buffer_size(buffer_size), sync_every(sync_every), rotate_size(rotate_size), rotate_keep(rotate_keep) { ; }
+    };
+
+    /**
+    * Appends text to a file which stays open between flushes. Output is
+    * collected in a large buffer and written with few system calls. commit()
+    * marks the end of a record, e.g. stats of one flush: buffered data is
+    * written, synced to disk according to `sync_every`, and the file is
+    * rotated if it grew over `rotate_size`. Records are never split between
+    * rotated files.
+    *
+    * The file is opened on first write, and reopened on the next write if
+    * writing fails, so a temporarily unavailable disk doesn't stop the
+    * backend. Data which can't be written is dropped. Not thread-safe.
+    */
+    class file_writer
+    {
+        std::string m_filename;
+        file_options m_options;
+        HANDLE m_file;
+        std::vector<char> m_buffer;
+        unsigned long long m_size;      // size of the file, including buffered data
+        unsigned int m_commits;         // since last sync
+        unsigned int m_failures;        // writes which dropped data
+
+        bool open();
+        void close();
+        void write_buffer();
+        void rotate();
+
+    public:
+        file_writer(const char* filename, const file_options& options);
+        ~file_writer();
+
+        /// appends data to the buffer
+        void write(const char* data, size_t len);
+        void write(const char* text) { write(text, strlen(text)); }
+        void write(const std::string& text) { write(text.data(), text.size()); }
+
+        /// appends formatted text to the buffer
+        void format(const char* fmt, ...);
+
+        /// ends a record, see class description
+        void commit();
+
+        /// returns true if nothing was written to the file yet, e.g. it was
+        /// just created or rotated, so a header is due
+        bool at_start();
+
+        /// returns the number of writes which failed and dropped data. when
+        /// it changes, the file may end with a partial record, so formats
+        /// which can't be resumed should start a new file
+        unsigned int failures() const { return m_failures; }
+
+        /// rotates the file if it isn't empty, e.g. to keep output of a
+        /// previous run out of a file with a header
+        void start_new();
+
+        /**
+        * Replaces the first line of the file, e.g. a header extended with
+        * new columns, by copying the file. Must be called between records.
+        * Readers following the file see it replaced.
+        * @param line the new first line, ending with a newline
+        * @return false if the file could not be rewritten and is unchanged
+        */
+        bool replace_first_line(const std::string& line);
+
+    private:
+        file_writer(const file_writer&);
+        file_writer& operator=(const file_writer&);
+    };
+}
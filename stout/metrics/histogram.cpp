@@ -0,0 +1,183 @@
+#include "stdafx.h"
+#include "histogram.h"
+#include <intrin.h>
+#include <math.h>
+
+namespace metrics
+{
+    void running_stats::merge(const running_stats& other)
+    {
+        if (other.count == 0) return;
+        if (count == 0) {
+            *this = other;
+            return;
+        }
+
+        if (other.min < min) min = other.min;
+        if (other.max > max) max = other.max;
+        double n = (double)(count + other.count);
+        double delta = other.mean - mean;
+        mean += delta * other.count / n;
+        m2 += other.m2 + delta * delta * count * other.count / n;
+        count += other.count;
+        sum += other.sum;
+    }
+
+    // summarizes the batch in two passes, the mean of the batch is known
+    // before the squared differences are summed, so no precision is lost
+    // to cancellation. the batch is then merged by Chan's formula
+    void running_stats::add(const int* values, size_t n)
+    {
+        if (n == 0) return;
+
+        running_stats batch;
+        int lo = values[0], hi = values[0];
+        long long sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            int v = values[i];
+            if (v < lo) lo = v;
+            if (v > hi) hi = v;
+            sum += v;
+        }
+
+        double mean = (double)sum / n;
+        double m2 = 0;
+        for (size_t i = 0; i < n; ++i) {
+            double d = values[i] - mean;
+            m2 += d * d;
+        }
+
+        batch.count = n;
+        batch.min = lo;
+        batch.max = hi;
+        batch.sum = sum;
+        batch.mean = mean;
+        batch.m2 = m2;
+        merge(batch);
+    }
+
+    sample_histogram::sample_histogram(unsigned int precision, arena* buckets) :
+        m_precision(precision),
+        m_offset(0),
+        m_counts(arena_allocator<unsigned int>(buckets)),
+        m_pending_count(0)
+    {;}
+
+    // maps value to a bucket index. indexes grow with values, negative
+    // values get negative indexes.
+    int sample_histogram::bucket(int value) const
+    {
+        unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+        int index;
+        if (u < (1u << m_precision)) {
+            index = (int)u;
+        }
+        else {
+            unsigned long msb;
+            _BitScanReverse(&msb, u);
+            unsigned int shift = msb - m_precision;
+            index = (int)(((shift + 1) << m_precision) + ((u >> shift) - (1u << m_precision)));
+        }
+        return value < 0 ? -index - 1 : index;
+    }
+
+    // returns the value in the middle of the bucket
+    long long sample_histogram::bucket_value(int index) const
+    {
+        bool negative = index < 0;
+        unsigned int i = negative ? (unsigned int)(-(index + 1)) : (unsigned int)index;
+
+        long long value = i;
+        if (i >= (1u << m_precision)) {
+            unsigned int shift = (i >> m_precision) - 1;
+            unsigned int sub = i & ((1u << m_precision) - 1);
+            long long lower = (long long)((1u << m_precision) + sub) << shift;
+            value = lower + (((1LL << shift) - 1) >> 1);
+        }
+        return negative ? -value : value;
+    }
+
+    unsigned int& sample_histogram::counter(int index) const
+    {
+        if (m_counts.empty()) {
+            m_offset = index;
+            m_counts.push_back(0);
+        }
+        else if (index < m_offset) {
+            m_counts.insert(m_counts.begin(), m_offset - index, 0);
+            m_offset = index;
+        }
+        else if (index - m_offset >= (int)m_counts.size()) {
+            m_counts.resize(index - m_offset + 1, 0);
+        }
+        return m_counts[index - m_offset];
+    }
+
+    void sample_histogram::fold() const
+    {
+        if (m_pending_count == 0) return;
+
+        m_stats.add(m_pending, m_pending_count);
+        for (unsigned int i = 0; i < m_pending_count; ++i) ++counter(bucket(m_pending[i]));
+        m_pending_count = 0;
+    }
+
+    void sample_histogram::merge(const sample_histogram& other)
+    {
+        fold();
+        other.fold();
+        if (other.m_stats.count == 0) return;
+
+        for (size_t i = 0; i < other.m_counts.size(); ++i) {
+            if (other.m_counts[i]) counter(other.m_offset + (int)i) += other.m_counts[i];
+        }
+        m_stats.merge(other.m_stats);
+    }
+
+    void sample_histogram::clear()
+    {
+        m_pending_count = 0;
+        if (m_stats.count == 0) return;
+        m_counts.assign(m_counts.size(), 0);
+        m_stats = running_stats();
+    }
+
+    void sample_histogram::release()
+    {
+        m_pending_count = 0;
+        std::vector<unsigned int, arena_allocator<unsigned int> >(m_counts.get_allocator()).swap(m_counts);
+        m_stats = running_stats();
+    }
+
+    int sample_histogram::quantile(double q) const
+    {
+        int value;
+        quantiles(&q, &value, 1);
+        return value;
+    }
+
+    void sample_histogram::quantiles(const double* q, int* values, size_t n) const
+    {
+        fold();
+        const running_stats& s = m_stats;
+        size_t k = 0;
+        unsigned long long seen = 0;
+        size_t i = 0;
+        for (; k < n; ++k) {
+            if (s.count == 0) { values[k] = 0; continue; }
+            if (q[k] <= 0) { values[k] = s.min; continue; }
+            if (q[k] >= 1) { values[k] = s.max; continue; }
+
+            unsigned long long rank = (unsigned long long)ceil(q[k] * s.count); // nearest rank
+
+            // continue from the bucket where the previous fraction was found
+            while (i < m_counts.size() && seen + m_counts[i] < rank) seen += m_counts[i++];
+            if (i == m_counts.size()) { values[k] = s.max; continue; }
+
+            long long value = bucket_value(m_offset + (int)i);
+            if (value < s.min) values[k] = s.min;
+            else if (value > s.max) values[k] = s.max;
+            else values[k] = (int)value;
+        }
+    }
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+#include "arena.h"
+
+namespace metrics
+{
+    /**
+    * Count, min, max, sum and variance of integer samples. Sum is kept in
+    * 64 bits and variance uses Welford's algorithm, so neither overflows
+    * nor loses precision for large values. Partial results are combined
+    * with Chan's formula, which is what makes batches and shards mergeable.
+    */
+    struct running_stats
+    {
+        unsigned long long count;
+        int min;
+        int max;
+        long long sum;
+        double mean;
+        double m2;      ///< sum of squared differences from the mean
+
+        running_stats() : count(0), min(0), max(0), sum(0), mean(0), m2(0) { ; }
+
+        /// adds a batch of samples
+        void add(const int* values, size_t n);
+
+        /// adds samples summarized in other stats
+        void merge(const running_stats& other);
+
+        /// returns population variance of the samples
+        double variance() const { return count ? m2 / count : 0; }
+    };
+
+    /**
+    * Streaming histogram of integer samples with bounded relative error,
+    * similar to HDR histogram. Each power of 2 range is split into
+    * 2^precision linear sub-buckets, so a reported quantile differs from
+    * the real one by at most 2^-precision relative. Values smaller than
+    * 2^precision are counted exactly. Negative values are mirrored into
+    * their own buckets.
+    *
+    * Memory depends only on the range of received values, and never exceeds
+    * 2 * (33 - precision) * 2^precision counters. Histograms with the same
+    * precision can be merged without losing accuracy.
+    *
+    * Buckets can be allocated from an arena, see release().
+    *
+    * Samples are buffered and folded into buckets and stats in batches.
+    * Readers fold pending samples first, so the buffer is not visible from
+    * outside. Folding may allocate buckets, so a histogram must be folded
+    * before several threads read it.
+    */
+    class sample_histogram
+    {
+        static const unsigned int batch_size = 16;
+
+        unsigned int m_precision;
+        mutable int m_offset;                       // bucket index of m_counts[0]
+        mutable std::vector<unsigned int, arena_allocator<unsigned int> > m_counts; // contiguous range of buckets
+        mutable running_stats m_stats;
+        mutable int m_pending[batch_size];          // samples not folded yet
+        mutable unsigned int m_pending_count;
+
+        int bucket(int value) const;
+        long long bucket_value(int index) const;
+        unsigned int& counter(int index) const;
+        void fold() const;
+
+    public:
+        /// creates an empty histogram, `precision` is in bits [1,10]. buckets
+        /// are allocated from `buckets` if specified, otherwise from the heap
+        explicit sample_histogram(unsigned int precision = 7, arena* buckets = NULL);
+
+        /// adds a single sample
+        void add(int value)
+        {
+            m_pending[m_pending_count++] = value;
+            if (m_pending_count == batch_size) fold();
+        }
+
+        /// adds all samples from other histogram with the same precision
+        void merge(const sample_histogram& other);
+
+        /// removes all samples, but keeps the memory for the next period
+        void clear();
+
+        /// removes all samples and gives up the bucket memory. must be called
+        /// before the arena holding the buckets is reset.
+        void release();
+
+        /**
+        * Returns the value below which the specified fraction of samples
+        * falls, e.g. 0.99 for 99th percentile. Result is clamped to min and
+        * max, so 0 and 1 return exact values. Returns 0 if empty.
+        */
+        int quantile(double q) const;
+
+        /// same as quantile() for `n` fractions in ascending order, but
+        /// walks the buckets only once
+        void quantiles(const double* q, int* values, size_t n) const;
+
+        /// folds pending samples into buckets. until the next add(), readers
+        /// don't modify the histogram and may run on several threads
+        void fold_pending() const { fold(); }
+
+        /// returns count, min, max, sum and variance of all samples
+        const running_stats& stats() const { fold(); return m_stats; }
+
+        /// returns the number of samples
+        unsigned long long size() const { return m_stats.count + m_pending_count; }
+        bool empty() const { return size() == 0; }
+        unsigned int precision() const { return m_precision; }
+    };
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "metrics.h"
+#include "bounded_queue.h"
+
+namespace metrics
+{
+    // metric passed through in-process queues. it is already parsed, so the
+    // receiver doesn't need to format or parse any text.
+    struct metric_record
+    {
+        char name[120];
+        metric_type type;
+        int value;
+        float rate;
+    };
+
+    typedef bounded_queue<metric_record> record_queue;
+
+    /// wakes up the consumer of a queue after a push, if it waits for records.
+    /// the consumer sets `*idle` before it checks the queue for the last time
+    /// and waits on `event`
+    inline void wake_consumer(volatile LONG* idle, HANDLE event)
+    {
+        if (idle && *idle && InterlockedExchange(idle, 0)) SetEvent(event);
+    }
+}
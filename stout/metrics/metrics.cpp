@@ -1,8 +1,16 @@
 #include "stdafx.h"
 #include "metrics.h"
+#include "sync.h"
+#include "metric_record.h"
+#include "metrics_server.h"
+#include "shared_memory.h"
 #include "string.h"
 #include "stdlib.h"
 #include <cstdarg>
+#include <climits>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
 
 #define thread_local __declspec( thread )
 
@@ -10,6 +18,57 @@ namespace metrics
 {
     client_config g_client;
 
+    // traffic counters, see get_client_stats()
+    volatile LONG g_datagrams_sent = 0;
+    volatile LONG g_lines_sent = 0;
+
+    // pending values of a single counter and gauge, when aggregating
+    struct aggregate
+    {
+        std::string name;    // copy of the metric name, METRIC_ID might be reused
+        long long count;     // sum of counter increments
+        long long delta;     // sum of gauge deltas
+        long long gauge;     // last absolute gauge value
+        bool has_count;
+        bool has_delta;
+        bool has_gauge;
+
+        aggregate() : count(0), delta(0), gauge(0), has_count(false), has_delta(false), has_gauge(false) { ; }
+    };
+
+    // per-thread client state, used for batching and aggregation
+    struct thread_data
+    {
+        critical_section lock;
+
+        // batching
+        std::vector<char> buff;
+        size_t len;
+        timer::time_point started_at;
+
+        // aggregation
+        std::unordered_map<METRIC_ID, aggregate> aggregates;
+
+        thread_data(size_t size) : buff(size), len(0), started_at(0) { ; }
+    };
+
+    // default size of per-thread buffers, fits into a typical ethernet MTU
+    const unsigned int default_batch_size = 1432;
+
+    record_queue* g_queue = NULL;     // async queue
+    HANDLE g_sender_event = NULL;     // wakes up idle sender thread
+    volatile LONG g_sender_idle = 0;  // set when sender waits for g_sender_event
+    volatile LONG g_dropped = 0;
+
+    // all thread states are registered here, so background thread can send
+    // batches which are waiting for too long and flush aggregated values.
+    // a state is released by FLS callback when its thread exits
+    std::vector<thread_data*> g_threads;
+    critical_section g_threads_lock;
+    DWORD g_thread_data_slot = FLS_OUT_OF_INDEXES;
+    thread_local thread_data* t_thread_data = NULL;
+    volatile LONG g_housekeeping_started = 0;
+
     void ensure_winsock_started()
     {
         SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -32,8 +91,25 @@ namespace metrics
     }
 
 
-    timer::time_point timer::now(){ return GetTickCount(); }
-    timer::duration timer::since(int when){ return now() - when; }
+    long long query_frequency()
+    {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        return freq.QuadPart;
+    }
+
+    const long long g_qpc_frequency = query_frequency();
+
+    timer::time_point timer::now()
+    {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        // split to avoid overflow of counter * 1e9
+        long long sec = counter.QuadPart / g_qpc_frequency;
+        long long rem = counter.QuadPart % g_qpc_frequency;
+        return sec * 1000000000LL + rem * 1000000000LL / g_qpc_frequency;
+    }
+    timer::duration timer::since(time_point when){ return now() - when; }
     std::string timer::to_string(timer::time_point time)
     { 
         auto diff = now() - time;
@@ -46,7 +122,7 @@ namespace metrics
         _ULARGE_INTEGER ui;
         ui.LowPart = tm.dwLowDateTime;
         ui.HighPart = tm.dwHighDateTime;
-        ULONGLONG back = diff * 1000;
+        ULONGLONG back = diff / 100;  // FILETIME is in 100 ns units
         ui.QuadPart = ui.QuadPart - back;
         tm.dwLowDateTime = ui.LowPart;
         tm.dwHighDateTime = ui.HighPart;
@@ -57,6 +133,18 @@ namespace metrics
         return txt; 
     }
 
+    long long timer::to_unix_ms(timer::time_point time)
+    {
+        FILETIME tm;
+        GetSystemTimeAsFileTime(&tm);
+
+        _ULARGE_INTEGER ui;
+        ui.LowPart = tm.dwLowDateTime;
+        ui.HighPart = tm.dwHighDateTime;
+        const ULONGLONG unix_epoch = 116444736000000000ULL; // 1970-01-01 in FILETIME units
+        return (long long)(ui.QuadPart - unix_epoch) / 10000 - to_ms(now() - time);
+    }
+
     client_config& setup_client(const std::string& server, unsigned int port)
     {
         if (server.size() < 1)  throw config_exception("specified server can't be an empty string");
@@ -85,9 +173,32 @@ namespace metrics
         return g_client;
     }
 
+    client_config& setup_client(const server& svr)
+    {
+        if (!svr.inproc_queue()) {
+            throw config_exception("server doesn't accept in-process clients, see server_config::enable_inproc");
+        }
+
+        g_client.m_server = "inproc";
+        g_client.m_port = svr.config().port();
+        g_client.m_overflow_policy = block_on_overflow; // there is no reason to lose metrics
+        g_client.m_inproc = svr.inproc_queue();
+        g_client.m_inproc_idle = svr.inproc_idle();
+        g_client.m_inproc_event = svr.inproc_event();
+        return g_client;
+    }
+
     client_config::client_config() :
         m_debug(false),
         m_defaults_period(60),
+        m_batch_size(0),
+        m_batch_age(0),
+        m_aggregation_period(0),
+        m_queue_size(0),
+        m_overflow_policy(drop_on_overflow),
+        m_inproc(NULL),
+        m_inproc_idle(NULL),
+        m_inproc_event(NULL),
         m_default_metrics(none),
         m_port(0),
         m_namespace("stats")
@@ -108,6 +219,61 @@ namespace metrics
         return *this;
     }
 
+    void start_housekeeping();
+
+    client_config& client_config::set_batching(unsigned int max_age, unsigned int max_size) {
+        if (max_age < 1 || max_age > 10000) throw config_exception("Valid batch age is 1-10000 ms");
+        if (max_size < 64 || max_size > 65507) throw config_exception("Valid batch size is 64-65507 bytes");
+        m_batch_age = max_age;
+        m_batch_size = max_size;
+        start_housekeeping();
+        return *this;
+    }
+
+    client_config& client_config::set_aggregation(unsigned int period) {
+        if (period < 10 || period > 60000) throw config_exception("Valid aggregation period is 10-60000 ms");
+        m_aggregation_period = period;
+        start_housekeeping();
+        return *this;
+    }
+
+    void start_sender(unsigned int queue_size);
+
+    client_config& client_config::set_async(unsigned int queue_size, overflow_policy policy) {
+        if (queue_size < 16 || queue_size > 1048576) throw config_exception("Valid queue size is 16-1048576");
+        if (m_queue_size > 0) throw config_exception("async sending is already turned on");
+        m_overflow_policy = policy;
+        start_sender(queue_size);
+        m_queue_size = g_queue->capacity(); // only now signal() starts using the queue
+        start_housekeeping();
+        return *this;
+    }
+
+    client_config& client_config::set_overflow_policy(overflow_policy policy) {
+        m_overflow_policy = policy;
+        return *this;
+    }
+
+    client_config& client_config::use_shared_memory(unsigned int queue_size) {
+        if (queue_size < 16 || queue_size > 1048576) throw config_exception("Valid queue size is 16-1048576");
+        if (m_port == 0) throw config_exception("client is not set up, see setup_client()");
+        if (m_inproc) return *this; // already pushing to a queue
+
+        volatile LONG* idle;
+        HANDLE event;
+        record_queue* queue = create_shm_client_queue(m_port, queue_size, &idle, &event);
+        if (!queue) {
+            dbg_print("shared memory transport is not available, using UDP");
+            return *this;
+        }
+
+        m_overflow_policy = block_on_overflow;
+        m_inproc_idle = idle;
+        m_inproc_event = event;
+        m_inproc = queue;
+        return *this;
+    }
+
     bool client_config::is_debug() const { return m_debug; }
     const char* client_config::get_namespace() const { return m_namespace.c_str(); }
 
@@ -115,6 +281,8 @@ namespace metrics
     {
         switch (m) {
             case histogram: return "%s.%s:%d|ms";
+            case timer_us: return "%s.%s:%d|us";
+            case timer_ns: return "%s.%s:%d|ns";
             case gauge: return "%s.%s:%d|g";
             case gauge_delta: return "%s.%s:%+d|g";
             case counter: return "%s.%s:%d|c";
@@ -122,6 +290,115 @@ namespace metrics
         }
     }
 
+    const char* type_suffix(metric_type m)
+    {
+        switch (m) {
+            case histogram: return "|ms";
+            case timer_us: return "|us";
+            case timer_ns: return "|ns";
+            case gauge: return "|g";
+            case gauge_delta: return "|g";
+            case counter: return "|c";
+            default: throw std::runtime_error("unsupported metric type");
+        }
+    }
+
+    // pairs of digits, used for fast integer formatting
+    const char g_digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    // writes the decimal representation of `val` to `out` and returns the
+    // number of characters written. `out` must have room for 11 characters
+    size_t format_int(int val, char* out, bool plus_sign)
+    {
+        char tmp[12];
+        char* p = tmp + sizeof(tmp);
+        unsigned int u = val < 0 ? 0u - (unsigned int)val : (unsigned int)val;
+
+        while (u >= 100) {
+            const char* pair = g_digit_pairs + (u % 100) * 2;
+            u /= 100;
+            *--p = pair[1];
+            *--p = pair[0];
+        }
+        if (u >= 10) {
+            const char* pair = g_digit_pairs + u * 2;
+            *--p = pair[1];
+            *--p = pair[0];
+        }
+        else {
+            *--p = (char)('0' + u);
+        }
+
+        if (val < 0) *--p = '-';
+        else if (plus_sign) *--p = '+';
+
+        size_t len = tmp + sizeof(tmp) - p;
+        memcpy(out, p, len);
+        return len;
+    }
+
+    // returns pseudo-random number in [0, 1), used for sampling
+    double random_unit()
+    {
+        thread_local static unsigned int state = 0;  // xorshift32
+        if (state == 0) state = ((GetCurrentThreadId() * 2654435761u) ^ GetTickCount()) | 1;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state * (1.0 / 4294967296.0);
+    }
+
+    // returns `true` if event should be sent, based on sample rate
+    inline bool is_sampled(double rate)
+    {
+        return rate >= 1.0 || random_unit() < rate;
+    }
+
+    double valid_rate(double rate, const char* metric)
+    {
+        if (rate > 0 && rate <= 1.0) return rate;
+        dbg_print("error: invalid sample rate %g for metric %s, using 1", rate, metric);
+        return 1.0;
+    }
+
+    handle::handle(METRIC_ID metric, metric_type type, double sample_rate) : 
+        m_prefix_len(0),
+        m_suffix_len(0),
+        m_type(type == gauge_delta ? gauge : type),
+        m_rate(1.0)
+    {
+        m_prefix[0] = '\0';
+        if (strncpy_s(m_name, _countof(m_name), metric, _TRUNCATE) == STRUNCATE) {
+            dbg_print("error: metric %s didn't fit", metric);
+            return;
+        }
+
+        int ret = _snprintf_s(m_prefix, _countof(m_prefix), _TRUNCATE, "%s.%s:", g_client.get_namespace(), metric);
+        if (ret < 1) {
+            dbg_print("error: metric %s didn't fit", metric);
+            m_prefix[0] = '\0';
+            return;
+        }
+
+        // gauges are never sampled
+        if (m_type != gauge) m_rate = valid_rate(sample_rate, metric);
+
+        if (m_rate < 1.0) _snprintf_s(m_suffix, _countof(m_suffix), _TRUNCATE, "%s|@%g", type_suffix(m_type), m_rate);
+        else strcpy_s(m_suffix, type_suffix(m_type));
+        m_suffix_len = (unsigned char)strlen(m_suffix);
+        m_prefix_len = (unsigned char)ret;
+    }
+
     void send_to_server(const char* txt, size_t len)
     {
         thread_local static SOCKET fd = INVALID_SOCKET;
@@ -139,6 +416,330 @@ namespace metrics
         if (sendto(fd, txt, len, 0, paddr, sizeof(*g_client.server_address())) == SOCKET_ERROR) {
             dbg_print("sendto failed, error: %d", WSAGetLastError());
         }
+        InterlockedIncrement(&g_datagrams_sent);
+    }
+
+    client_stats get_client_stats()
+    {
+        client_stats stats = { 
+            (unsigned int)g_datagrams_sent, 
+            (unsigned int)g_lines_sent,
+            g_queue ? g_queue->size() : 0,
+            (unsigned int)g_dropped
+        };
+        return stats;
+    }
+
+    // sends the content of the batch. caller must hold the thread lock
+    void send_batch(thread_data* td)
+    {
+        if (td->len == 0) return;
+        send_to_server(&td->buff[0], td->len);
+        td->len = 0;
+    }
+
+    void WINAPI release_thread_data(void* data);
+
+    thread_data* get_thread_data()
+    {
+        if (!t_thread_data) {
+            auto size = g_client.is_batching() ? g_client.batch_size() : default_batch_size;
+            thread_data* td = new thread_data(size);
+            scoped_lock _(g_threads_lock);
+            if (g_thread_data_slot == FLS_OUT_OF_INDEXES) {
+                g_thread_data_slot = FlsAlloc(release_thread_data);
+                if (g_thread_data_slot == FLS_OUT_OF_INDEXES) dbg_print("FlsAlloc failed, error: %d", GetLastError());
+            }
+            if (g_thread_data_slot != FLS_OUT_OF_INDEXES) FlsSetValue(g_thread_data_slot, td);
+            g_threads.push_back(td);
+            t_thread_data = td;
+        }
+        return t_thread_data;
+    }
+
+    // appends the metric to the batch. if there is no room, batch is sent
+    // first. caller must hold the thread lock
+    void append_to_batch(thread_data* td, const char* txt, size_t len)
+    {
+        if (td->len && td->len + len + 1 > td->buff.size()) send_batch(td); // +1 for '\n' separator
+
+        if (len > td->buff.size()) { // wouldn't fit even in empty buffer
+            send_to_server(txt, len);
+            return;
+        }
+
+        if (td->len == 0) td->started_at = timer::now();
+        else td->buff[td->len++] = '\n';
+        memcpy(&td->buff[td->len], txt, len);
+        td->len += len;
+    }
+
+    void add_to_batch(const char* txt, size_t len)
+    {
+        thread_data* td = get_thread_data();
+        scoped_lock _(td->lock);
+
+        append_to_batch(td, txt, len);
+        if (timer::since_ms(td->started_at) >= g_client.batch_age()) send_batch(td);
+    }
+
+    // sends batches from all threads. if `stale_only` is true, only batches
+    // older than the configured age are sent
+    void flush_batches(bool stale_only)
+    {
+        scoped_lock _(g_threads_lock);
+        FOR_EACH (auto td, g_threads) {
+            scoped_lock __(td->lock);
+            if (stale_only && timer::since_ms(td->started_at) < g_client.batch_age()) continue;
+            send_batch(td);
+        }
+    }
+
+    template <metric_type m> void send_metric(const char* metric, int val, double rate = 1.0);
+
+    // deltas are sent as int, so huge ones are split across lines
+    void send_gauge_delta(const char* name, long long delta)
+    {
+        while (delta > INT_MAX) { send_metric<gauge_delta>(name, INT_MAX); delta -= INT_MAX; }
+        while (delta < INT_MIN) { send_metric<gauge_delta>(name, INT_MIN); delta -= INT_MIN; }
+        send_metric<gauge_delta>(name, (int)delta);
+    }
+
+    // sends aggregated values and resets the aggregate.
+    void send_aggregate(aggregate& a)
+    {
+        const char* name = a.name.c_str();
+        if (a.has_count) {
+            // counters are sent as int, so huge sums are split across lines
+            while (a.count > INT_MAX) { send_metric<counter>(name, INT_MAX); a.count -= INT_MAX; }
+            while (a.count < INT_MIN) { send_metric<counter>(name, INT_MIN); a.count -= INT_MIN; }
+            send_metric<counter>(name, (int)a.count);
+        }
+        if (a.has_gauge) {
+            // a negative value would be read as a delta, so like without
+            // aggregation, the gauge is set to 0 and decreased
+            long long value = a.gauge + a.delta;
+            send_metric<gauge>(name, value < 0 ? 0 : (int)value);
+            if (value < 0) send_gauge_delta(name, value);
+        }
+        else if (a.has_delta) {
+            send_gauge_delta(name, a.delta);
+        }
+        a.count = a.delta = a.gauge = 0;
+        a.has_count = a.has_delta = a.has_gauge = false;
+    }
+
+    template <metric_type m>
+    void aggregate_metric(const char* metric, int val)
+    {
+        thread_data* td = get_thread_data();
+        scoped_lock _(td->lock);
+
+        aggregate& a = td->aggregates[metric];
+        if (a.name != metric) { // new entry, or METRIC_ID was reused for another name
+            send_aggregate(a);
+            a.name = metric;
+        }
+
+        switch (m) {
+            case counter: a.count += val; a.has_count = true; break;
+            case gauge: a.gauge = (unsigned int)val; a.delta = 0; a.has_gauge = true; break;
+            case gauge_delta: a.delta += val; a.has_delta = true; break;
+        }
+    }
+
+    // sends aggregated values from all threads
+    void flush_aggregates()
+    {
+        scoped_lock _(g_threads_lock);
+        FOR_EACH (auto td, g_threads) {
+            scoped_lock __(td->lock);
+            for (auto it = td->aggregates.begin(); it != td->aggregates.end(); ++it) {
+                send_aggregate(it->second);
+            }
+        }
+    }
+
+    // called when a thread exits, sends what the thread left and frees its state
+    void WINAPI release_thread_data(void* data)
+    {
+        thread_data* td = static_cast<thread_data*>(data);
+        {
+            scoped_lock _(g_threads_lock);
+            g_threads.erase(std::remove(g_threads.begin(), g_threads.end(), td), g_threads.end());
+        }
+        {
+            scoped_lock _(td->lock);
+            for (auto it = td->aggregates.begin(); it != td->aggregates.end(); ++it) {
+                send_aggregate(it->second); // may append to the batch of this thread
+            }
+            send_batch(td);
+        }
+        if (t_thread_data == td) t_thread_data = NULL;
+        delete td;
+    }
+
+    int format_metric(metric_type m, char* txt, size_t size, const char* metric, int val, double rate);
+
+    DWORD WINAPI sender_proc(LPVOID)
+    {
+        thread_data* td = get_thread_data();
+        metric_record r;
+        char txt[256];
+
+        while (true) {
+            {
+                scoped_lock _(td->lock);
+                while (g_queue->pop(r)) {
+                    int len = format_metric(r.type, txt, _countof(txt), r.name, r.value, r.rate);
+                    if (len < 1) continue;
+                    InterlockedIncrement(&g_lines_sent);
+                    append_to_batch(td, txt, len);
+                }
+                send_batch(td);   // queue is empty, no reason to wait
+            }
+
+            InterlockedExchange(&g_sender_idle, 1);
+            if (g_queue->size() == 0) WaitForSingleObject(g_sender_event, 100);
+            InterlockedExchange(&g_sender_idle, 0);
+        }
+    }
+
+    void start_sender(unsigned int queue_size)
+    {
+        g_queue = new record_queue(queue_size);
+        g_sender_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (!g_sender_event) throw config_exception("Failed creating sender event");
+
+        DWORD thread_id;
+        HANDLE h = CreateThread(NULL, 0, sender_proc, NULL, 0, &thread_id);
+        if (!h) throw config_exception("Failed creating client sender thread");
+        CloseHandle(h);
+        dbg_print("started client sender on thread %d", thread_id);
+    }
+
+    // pushes the record to the queue, applying the overflow policy.
+    // `wake` is signaled while waiting for room in the queue
+    bool push_record(record_queue* queue, const metric_record& r, HANDLE wake)
+    {
+        while (!queue->push(r)) {
+            if (g_client.get_overflow_policy() == drop_on_overflow) {
+                InterlockedIncrement(&g_dropped);
+                return false;
+            }
+            if (wake) SetEvent(wake);
+            SwitchToThread();
+        }
+        return true;
+    }
+
+    void enqueue_metric(metric_type m, const char* metric, int val, double rate)
+    {
+        metric_record r;
+        if (strncpy_s(r.name, _countof(r.name), metric, _TRUNCATE) == STRUNCATE) {
+            dbg_print("error: metric %s didn't fit", metric);
+            InterlockedIncrement(&g_dropped);
+            return;
+        }
+        r.type = m;
+        r.value = val;
+        r.rate = (float)rate;
+
+        if (!push_record(g_queue, r, g_sender_event)) return;
+        wake_consumer(&g_sender_idle, g_sender_event);
+    }
+
+    // pushes the metric directly to the server in the same process. `name`
+    // already contains the namespace and is `len` characters long
+    void push_inproc(metric_type m, const char* name, size_t len, int val, double rate)
+    {
+        metric_record r;
+        if (len >= _countof(r.name)) {
+            dbg_print("error: metric %.*s didn't fit", (int)len, name);
+            InterlockedIncrement(&g_dropped);
+            return;
+        }
+        memcpy(r.name, name, len);
+        r.name[len] = '\0';
+        r.type = m;
+        r.value = val;
+        r.rate = (float)rate;
+
+        if (!push_record(g_client.inproc_queue(), r, g_client.inproc_event())) return;
+        wake_consumer(g_client.inproc_idle(), g_client.inproc_event());
+    }
+
+    void push_inproc(metric_type m, const char* metric, int val, double rate)
+    {
+        char name[256];
+        const char* ns = g_client.get_namespace();
+        size_t ns_len = strlen(ns);
+        size_t len = strlen(metric);
+        if (ns_len + len + 1 >= _countof(name)) {
+            dbg_print("error: metric %s didn't fit", metric);
+            InterlockedIncrement(&g_dropped);
+            return;
+        }
+        memcpy(name, ns, ns_len);
+        name[ns_len] = '.';
+        memcpy(name + ns_len + 1, metric, len);
+        push_inproc(m, name, ns_len + len + 1, val, rate);
+    }
+
+    void flush()
+    {
+        if (g_client.is_aggregating()) flush_aggregates();
+        if (g_client.is_async()) {
+            while (g_queue->size() > 0) {
+                SetEvent(g_sender_event);
+                Sleep(1);
+            }
+        }
+        if (g_client.is_batching() || g_client.is_async()) flush_batches(false);
+    }
+
+    void report_internal_metrics();
+
+    DWORD WINAPI housekeeping_proc(LPVOID)
+    {
+        auto last_report = timer::now();
+        auto last_aggregation = timer::now();
+        while (true) {
+            unsigned int tick = 1000;
+            if (g_client.is_batching() && g_client.batch_age() / 2 < tick) tick = g_client.batch_age() / 2;
+            if (g_client.is_aggregating() && g_client.aggregation_period() / 4 < tick) tick = g_client.aggregation_period() / 4;
+            Sleep(tick < 10 ? 10 : tick);
+
+            if (g_client.is_aggregating() &&
+                timer::since_ms(last_aggregation) >= g_client.aggregation_period()) {
+                last_aggregation = timer::now();
+                flush_aggregates();
+            }
+            if (g_client.is_batching()) flush_batches(true);
+
+            if ((g_client.default_metrics() & metrics) &&
+                timer::since_ms(last_report) >= g_client.default_metrics_period() * 1000) {
+                last_report = timer::now();
+                report_internal_metrics();
+            }
+        }
+    }
+
+    // starts the background thread which sends stale batches, flushes
+    // aggregated values and reports internal client metrics. thread is
+    // started only once.
+    void start_housekeeping()
+    {
+        if (InterlockedCompareExchange(&g_housekeeping_started, 1, 0) != 0) return;
+
+        DWORD thread_id;
+        HANDLE h = CreateThread(NULL, 0, housekeeping_proc, NULL, 0, &thread_id);
+        if (!h) {
+            g_housekeeping_started = 0;
+            throw config_exception("Failed creating client housekeeping thread");
+        }
+        CloseHandle(h);
+        dbg_print("started client housekeeping on thread %d", thread_id);
     }
 
     inline void dbg_print(const char* fmt, ...) {
@@ -152,32 +753,156 @@ namespace metrics
         printf("\n");
     }
 
+    void emit(const char* txt, size_t len)
+    {
+        InterlockedIncrement(&g_lines_sent);
+        if (g_client.is_batching()) add_to_batch(txt, len);
+        else send_to_server(txt, len);
+    }
+
+    // formats the metric into the buffer, returns the length of the text
+    // or a value < 1 if the metric didn't fit
+    int format_metric(metric_type m, char* txt, size_t size, const char* metric, int val, double rate) {
+        auto ns = g_client.get_namespace();
+        int ret = _snprintf_s(txt, size, _TRUNCATE, fmt(m), ns, metric, val);
+        if (ret > 0 && rate < 1.0) {
+            int len = _snprintf_s(txt + ret, size - ret, _TRUNCATE, "|@%g", rate);
+            ret = len < 1 ? len : ret + len;
+        }
+        if (ret < 1) dbg_print("error: metric %s didn't fit", metric);
+        return ret;
+    }
+
+    // formats the metric and sends it, bypassing aggregation and async queue
     template <metric_type m>
-    void signal(const char* metric, int val) {
+    void send_metric(const char* metric, int val, double rate) {
+        if (g_client.is_inproc()) {
+            push_inproc(m, metric, val, rate);
+            return;
+        }
+
         char txt[256]; 
-        auto ns = g_client.get_namespace();
-        int ret = _snprintf_s(txt, _countof(txt), _TRUNCATE, fmt(m), ns, metric, val);
+        int ret = format_metric(m, txt, _countof(txt), metric, val, rate);
+        if (ret > 0) {
+            emit(txt, ret);
+            dbg_print("%s", txt);
+        }
+    }
 
-        if (ret < 1) {
-            dbg_print("error: metric %s didn't fit", metric);
+    // aggregated counters are exact, so sample rate is ignored for them.
+    // gauges are never sampled.
+    template <metric_type m>
+    void signal(const char* metric, int val, double rate = 1.0) {
+        if (!is_timer(m) && g_client.is_aggregating()) {
+            aggregate_metric<m>(metric, val);
+            return;
         }
+        if (rate != 1.0) rate = valid_rate(rate, metric); // scaled by 1/rate downstream
+        if (!is_sampled(rate)) return;
+        else if (g_client.is_inproc()) push_inproc(m, metric, val, rate);
+        else if (g_client.is_async()) enqueue_metric(m, metric, val, rate);
+        else send_metric<m>(metric, val, rate);
+    }
+
+    // sends the metric using pre-rendered text from the handle
+    template <metric_type m>
+    void signal(const handle& h, int val) {
+        metric_type expected = (m == gauge_delta) ? gauge : m;
+        if (h.type() != expected && !(m == histogram && is_timer(h.type()))) {
+            dbg_print("error: metric %s is not of type %d", h.name(), m);
+            return;
+        }
+        if (!h.is_valid()) {
+            dbg_print("error: metric %s has invalid handle", h.name());
+            return;
+        }
+
+        if (!is_timer(m) && g_client.is_aggregating()) aggregate_metric<m>(h.name(), val);
+        else if (!is_sampled(h.sample_rate())) return;
+        else if (g_client.is_inproc()) {
+            // prefix is "ns.metric:", so only the colon is skipped
+            push_inproc(m == histogram ? h.type() : m, h.prefix(), h.prefix_len() - 1, val, h.sample_rate());
+        }
+        else if (g_client.is_async()) enqueue_metric(m == histogram ? h.type() : m, h.name(), val, h.sample_rate());
         else {
-            send_to_server(txt, strlen(txt));
-            dbg_print("%s", txt);
+            char txt[192];
+            char* p = txt;
+            memcpy(p, h.prefix(), h.prefix_len());
+            p += h.prefix_len();
+            p += format_int(val, p, m == gauge_delta);
+            memcpy(p, h.suffix(), h.suffix_len());
+            p += h.suffix_len();
+
+            emit(txt, p - txt);
+            if (g_client.is_debug()) {
+                *p = '\0';
+                dbg_print("%s", txt);
+            }
+        }
+    }
+
+    void report_internal_metrics()
+    {
+        static client_stats last = { 0, 0, 0, 0 };
+        client_stats current = get_client_stats();
+        client_stats period = { 
+            current.datagrams - last.datagrams, 
+            current.lines - last.lines, 
+            current.queued, 
+            current.dropped - last.dropped 
+        };
+        last = current;
+
+        send_metric<counter>(builtin::internal_client_datagrams, (int)period.datagrams);
+        send_metric<gauge>(builtin::internal_client_lines_per_datagram, (int)(period.lines_per_datagram() + 0.5));
+        if (g_client.is_async()) {
+            send_metric<gauge>(builtin::internal_client_queue_depth, (int)period.queued);
+            send_metric<counter>(builtin::internal_client_dropped, (int)period.dropped);
+        }
+    }
+
+    // converts the duration to the unit, clamped to int range
+    int to_unit(timer::duration d, timer_unit unit)
+    {
+        long long v = d;
+        switch (unit) {
+            case milliseconds: v = timer::to_ms(d); break;
+            case microseconds: v = timer::to_us(d); break;
+            case nanoseconds: break;
+        }
+        return v > INT_MAX ? INT_MAX : (int)v;
+    }
+
+    timer_unit unit_of(metric_type m)
+    {
+        switch (m) {
+            case timer_us: return microseconds;
+            case timer_ns: return nanoseconds;
+            default: return milliseconds;
         }
     }
 
-    auto_timer::auto_timer(METRIC_ID metric) : m_metric(metric), m_started_at(timer::now()) {}
-    auto_timer::~auto_timer() { signal<histogram>(m_metric, timer::since(m_started_at)); }
+    auto_timer::auto_timer(METRIC_ID metric, timer_unit unit) : 
+        m_metric(metric), m_handle(NULL), m_unit(unit), m_started_at(timer::now()) {}
+    auto_timer::auto_timer(const handle& h) : 
+        m_metric(h.name()), m_handle(&h), m_unit(unit_of(h.type())), m_started_at(timer::now()) {}
+    auto_timer::~auto_timer() 
+    {
+        int elapsed = to_unit(timer::since(m_started_at), m_unit);
+        if (m_handle) signal<histogram>(*m_handle, elapsed);
+        else if (m_unit == microseconds) signal<timer_us>(m_metric, elapsed);
+        else if (m_unit == nanoseconds) signal<timer_ns>(m_metric, elapsed);
+        else signal<histogram>(m_metric, elapsed); 
+    }
 
-    void inc(METRIC_ID metric, int inc)
+    void inc(METRIC_ID metric, int inc, double sample_rate)
     {
-        signal<counter>(metric, inc);
+        signal<counter>(metric, inc, sample_rate);
     }
 
-    void measure(METRIC_ID metric, int value)
+    void measure(METRIC_ID metric, int value, double sample_rate)
     {
-        signal<histogram>(metric, value);
+        signal<histogram>(metric, value, sample_rate);
     }
 
     void set(METRIC_ID metric, unsigned int value)
@@ -189,4 +914,24 @@ namespace metrics
     {
         signal<gauge_delta>(metric, value);
     }
+
+    void inc(const handle& h, int inc)
+    {
+        signal<counter>(h, inc);
+    }
+
+    void measure(const handle& h, int value)
+    {
+        signal<histogram>(h, value);
+    }
+
+    void set(const handle& h, unsigned int value)
+    {
+        signal<gauge>(h, value);
+    }
+
+    void set_delta(const handle& h, int value)
+    {
+        signal<gauge_delta>(h, value);
+    }
 }
\ No newline at end of file
@@ -11,9 +11,22 @@ namespace metrics
     enum metric_type
     {
         counter,
-        histogram,
+        histogram,     ///< timer/histogram, timers are in milliseconds
         gauge,
-        gauge_delta
+        gauge_delta,
+        timer_us,      ///< timer in microseconds, reported by the server as series `<name>.us`
+        timer_ns       ///< timer in nanoseconds, reported by the server as series `<name>.ns`
+    };
+
+    /// returns `true` for histogram and timers in all units
+    inline bool is_timer(metric_type m) { return m == histogram || m == timer_us || m == timer_ns; }
+
+    /// Units in which auto_timer reports the measured time
+    enum timer_unit
+    {
+        milliseconds,  ///< sent as `|ms`
+        microseconds,  ///< sent as `|us`
+        nanoseconds    ///< sent as `|ns`, limited to ~2.1 s
     };
 
     /// Represents different groups of built-in metrics. These can be combined
@@ -30,6 +43,14 @@ namespace metrics
         all     = 0xFFFF   ///< track all metrics
     };
 
+    /// Specifies what asynchronous client does when its queue is full
+    /// @see client_config::set_async
+    enum overflow_policy
+    {
+        drop_on_overflow,  ///< metric is dropped and counted
+        block_on_overflow  ///< caller waits until there is room in the queue
+    };
+
     struct SOCK_ADDR_IN : public sockaddr_in {
         SOCK_ADDR_IN() {
             memset((char *)this, 0, sizeof(SOCK_ADDR_IN));
@@ -59,14 +80,22 @@ namespace metrics
     // used as a workaround for the fact that VS2010 doesn't support std::chrono
     // while std::chrono is broken in VS2013, see:
     // https://connect.microsoft.com/VisualStudio/feedback/details/719443/
+    // backed by QueryPerformanceCounter, which is monotonic and uses invariant
+    // TSC where available.
     class timer
     {
     public:
-        typedef int time_point;  // todo: ULONGLONG, int is limited to ~50 days
-        typedef int duration;
+        typedef long long time_point;  ///< monotonic time, in nanoseconds
+        typedef long long duration;    ///< in nanoseconds
         static time_point now();
-        static duration since(int when);
+        static duration since(time_point when);
+        /// returns the time elapsed since `when`, in milliseconds
+        static long long since_ms(time_point when) { return to_ms(since(when)); }
+        static long long to_ms(duration d) { return d / 1000000; }
+        static long long to_us(duration d) { return d / 1000; }
         static std::string to_string(timer::time_point time);
+        /// returns the wall clock time of `time`, in milliseconds since 1970-01-01 UTC
+        static long long to_unix_ms(timer::time_point time);
     };
     /// used to notify client code about errors during client or server
     /// configuration
@@ -80,6 +109,13 @@ namespace metrics
     namespace builtin {
         const char internal_metrics_count[] = "metrics.internal.count"; ///< Number of metrics tracked
         const char internal_metrics_last_seen[] = "metrics.internal.last_seen"; ///< timestamp of last metric
+        const char internal_flush_duration[] = "metrics.internal.flush_duration"; ///< Duration of the previous flush, in us
+        const char internal_backend[] = "metrics.internal.backend"; ///< Prefix of backend metrics, followed by backend name, see backend_options
+        const char internal_flush_overlaps[] = "metrics.internal.flush_overlaps"; ///< Number of flushes skipped because the previous one was still running
+        const char internal_client_datagrams[] = "metrics.internal.client.datagrams"; ///< Number of datagrams sent by client
+        const char internal_client_lines_per_datagram[] = "metrics.internal.client.lines_per_datagram"; ///< Average number of metrics per datagram
+        const char internal_client_queue_depth[] = "metrics.internal.client.queue_depth"; ///< Number of metrics waiting in async queue
+        const char internal_client_dropped[] = "metrics.internal.client.dropped"; ///< Number of metrics dropped due to full async queue
 
         // GlobalMemoryStatusEx, GetPerformanceInfo, GetSystemTimes
         const char sys_mem_phys_used[] = "sys.mem.phys.total"; ///< Total physical memory
@@ -108,6 +144,9 @@ namespace metrics
     }
 
     class client_config;
+    class server;
+    struct metric_record;
+    template <typename T> class bounded_queue;
 
     /**
     * Configures metrics client.
@@ -133,16 +172,49 @@ namespace metrics
     */
     client_config& setup_client(const std::string& server, unsigned int port = 9999);
 
+    /**
+    * Configures metrics client to send metrics directly to the server running
+    * in the same process. Metrics are pushed, already parsed, into server's
+    * lock-free queue, so there is no formatting, socket traffic or parsing.
+    * As there is no socket buffer which could overflow, callers wait when
+    * the queue is full, unless set_overflow_policy() says otherwise.
+    *
+    * Namespace and metric name together must be shorter than 120 characters.
+    *
+    * @param svr Running server, configured with server_config::enable_inproc
+    * @throws config_exception Thrown if server doesn't accept in-process
+    *         clients
+    *
+    * Example:
+    * ~~~{.cpp}
+    * auto svr = metrics::server::run(metrics::server_config(9999).enable_inproc());
+    * metrics::setup_client(svr)
+    *     .set_namespace("myapp");
+    * ~~~
+    *
+    * @see server_config::enable_inproc
+    */
+    client_config& setup_client(const server& svr);
+
     /**
     * handles client settings.
     */
     class client_config
     {
         friend client_config& setup_client(const std::string& server, unsigned int port);
+        friend client_config& setup_client(const server& svr);
 
         bool m_debug;
         unsigned int m_port;
         unsigned int m_defaults_period;
+        unsigned int m_batch_size;
+        unsigned int m_batch_age;
+        unsigned int m_aggregation_period;
+        unsigned int m_queue_size;
+        overflow_policy m_overflow_policy;
+        bounded_queue<metric_record>* m_inproc;
+        volatile LONG* m_inproc_idle;
+        HANDLE m_inproc_event;
         builtin_metric m_default_metrics;
         std::string m_namespace;
         std::string m_server;
@@ -178,6 +250,113 @@ namespace metrics
         */
         client_config& set_namespace(const std::string& ns);
 
+        /**
+        * Turns on batching of metrics. Instead of sending a datagram for each
+        * metric, each thread collects newline separated metrics in a buffer
+        * which is sent when it gets full, or when the oldest metric in it
+        * becomes older than `max_age`. By default, batching is turned off.
+        *
+        * If internal metrics are tracked (see track_default_metrics), client
+        * will report the number of sent datagrams and average number of
+        * metrics per datagram.
+        *
+        * @param max_age Maximum time, in ms, metric can wait in the buffer.
+        *                The default is 50 ms, valid values are [1,10000]
+        * @param max_size Maximum size of a datagram, in bytes. The default
+        *                 value of 1432 fits into a typical ethernet MTU. Valid
+        *                 values are [64,65507]
+        * @throws config_exception Thrown if invalid values are specified
+        *
+        * Example:
+        * ~~~{.cpp}
+        * metrics::setup_client("127.0.0.1", 9999)
+        *     .set_batching(100)                    // send at least every 100 ms
+        *     .track_default_metrics(metrics::metrics);
+        * ~~~
+        */
+        client_config& set_batching(unsigned int max_age = 50, unsigned int max_size = 1432);
+
+        /**
+        * Turns on aggregation of counters and gauges on the client. Each
+        * thread sums the counter increments and keeps the last gauge value
+        * locally, and a background thread sends one metric per counter/gauge
+        * every `period` ms. Timers/histograms are not aggregated. By default,
+        * aggregation is turned off.
+        *
+        * Aggregated values are keyed by METRIC_ID, so metric names should be
+        * string literals or other strings which don't change their address.
+        * Reusing the same buffer for different names is supported, but it
+        * causes the pending value to be sent immediately.
+        *
+        * @param period How often, in ms, aggregated values are sent. The
+        *               default is 1000 ms, valid values are [10,60000]
+        * @throws config_exception Thrown if invalid period is specified
+        *
+        * Example:
+        * ~~~{.cpp}
+        * metrics::setup_client("127.0.0.1", 9999)
+        *     .set_aggregation(500)  // send counters and gauges twice a second
+        *     .set_batching();       // and pack them in as few datagrams as possible
+        * ~~~
+        */
+        client_config& set_aggregation(unsigned int period = 1000);
+
+        /**
+        * Turns on asynchronous sending. Instead of formatting and sending the
+        * metric on the calling thread, metric name, type and value are pushed
+        * into a bounded lock-free queue. A dedicated sender thread drains the
+        * queue, formats the metrics and sends them packed in as few datagrams
+        * as possible. By default, metrics are sent synchronously.
+        *
+        * Metric names are copied into the queue, names longer than 119
+        * characters are dropped. If internal metrics are tracked, client
+        * reports the queue depth and the number of dropped metrics.
+        *
+        * @param queue_size Capacity of the queue, rounded up to the power of
+        *                   2. The default is 8192, valid values are
+        *                   [16,1048576]
+        * @param policy What to do when the queue is full. By default, the
+        *               metric is dropped and counted.
+        * @throws config_exception Thrown if invalid queue size is specified
+        *         or sender thread can't be started
+        *
+        * Example:
+        * ~~~{.cpp}
+        * metrics::setup_client("127.0.0.1", 9999)
+        *     .set_async(65536, metrics::block_on_overflow) // never lose a metric
+        *     .track_default_metrics(metrics::metrics);     // report queue stats
+        * ~~~
+        */
+        client_config& set_async(unsigned int queue_size = 8192, overflow_policy policy = drop_on_overflow);
+
+        /**
+        * Specifies what happens when the async or in-process queue is full.
+        * @param policy Drop and count the metric, or wait for room in queue
+        */
+        client_config& set_overflow_policy(overflow_policy policy);
+
+        /**
+        * Sends metrics to the server on the same host through shared memory
+        * instead of UDP. Client pushes parsed metrics into its own queue in a
+        * named file mapping, which is drained by the server. If the server
+        * doesn't accept shared memory clients, UDP is used as before.
+        * Overflow policy is set to metrics::block_on_overflow.
+        *
+        * @param queue_size Capacity of the queue, rounded up to the power of
+        *                   2. The default is 65536, valid values are
+        *                   [16,1048576]
+        * @throws config_exception Thrown if invalid queue size is specified
+        *         or client is not set up yet
+        *
+        * Example:
+        * ~~~{.cpp}
+        * metrics::setup_client("127.0.0.1", 9999).use_shared_memory();
+        * ~~~
+        *
+        * @see server_config::enable_shared_memory
+        */
+        client_config& use_shared_memory(unsigned int queue_size = 65536);
+
         /**
         * Returns whether the debug tracing is active
         * @return `true` if debug tracing is on, `false` otherwise.
@@ -190,12 +369,130 @@ namespace metrics
         */
         const char* get_namespace() const;
 
+        /// returns `true` if client batches metrics before sending them
+        bool is_batching() const { return m_batch_size > 0; }
+        /// returns the maximum size of a batched datagram, 0 if not batching
+        unsigned int batch_size() const { return m_batch_size; }
+        /// returns the maximum time, in ms, a metric can wait in a batch
+        unsigned int batch_age() const { return m_batch_age; }
+        /// returns `true` if counters and gauges are aggregated on the client
+        bool is_aggregating() const { return m_aggregation_period > 0; }
+        /// returns how often, in ms, aggregated values are sent
+        unsigned int aggregation_period() const { return m_aggregation_period; }
+        /// returns `true` if metrics are sent from a dedicated sender thread
+        bool is_async() const { return m_queue_size > 0; }
+        /// returns the capacity of the async queue, 0 if not async
+        unsigned int queue_size() const { return m_queue_size; }
+        /// returns `true` if metrics are pushed directly to server queue, either
+        /// in the same process or through shared memory
+        bool is_inproc() const { return m_inproc != NULL; }
+        /// returns the in-process or shared memory queue, NULL if not used
+        bounded_queue<metric_record>* inproc_queue() const { return m_inproc; }
+        /// returns the flag set while the server waits for records of inproc_queue()
+        volatile LONG* inproc_idle() const { return m_inproc_idle; }
+        /// returns the event which wakes up the server waiting for records of inproc_queue()
+        HANDLE inproc_event() const { return m_inproc_event; }
+        /// returns what happens when the async or in-process queue is full
+        overflow_policy get_overflow_policy() const { return m_overflow_policy; }
+        /// returns which groups of builtin metrics are tracked
+        builtin_metric default_metrics() const { return m_default_metrics; }
+        /// returns how often, in seconds, builtin metrics are collected
+        unsigned int default_metrics_period() const { return m_defaults_period; }
+
         const sockaddr_in* server_address() const { return &m_svr_address; }
 
     };
 
     extern client_config  g_client;
 
+    /**
+    * Pre-registered metric. Handle renders the "namespace.metric:" prefix and
+    * type suffix once, when it is created, so sending a metric through a
+    * handle only needs to convert the value to text and copy the bytes.
+    * Use it for metrics which are updated very often.
+    *
+    * The namespace is captured when handle is created, so create handles
+    * after the client is configured. Function-local statics are not
+    * initialized thread-safely by VS2013, so don't keep handles in them if
+    * several threads may run the function first. Handles are cheap to copy.
+    *
+    * ~~~ {.cpp}
+    * class request_handler {
+    *     metrics::handle m_requests;
+    * public:
+    *     request_handler() : m_requests("app.requests", metrics::counter) { ; }
+    *     void on_request() {
+    *         metrics::inc(m_requests);
+    *         ...
+    *     }
+    * };
+    * ~~~
+    */
+    class handle
+    {
+        char m_name[120];      // copy of the metric name
+        char m_prefix[160];    // "ns.metric:"
+        char m_suffix[24];     // "|c", "|ms" or "|g", followed by "|@rate" if sampled
+        unsigned char m_prefix_len;
+        unsigned char m_suffix_len;
+        metric_type m_type;
+        double m_rate;
+
+    public:
+        /**
+        * Creates a handle for the metric.
+        * @param metric The name of the metric
+        * @param type The type of the metric. gauge_delta is treated as gauge.
+        * @param sample_rate Fraction of events which are sent to the server,
+        *        in range (0,1]. Server scales the values accordingly. Ignored
+        *        for gauges and for counters when client aggregates them.
+        */
+        handle(METRIC_ID metric, metric_type type, double sample_rate = 1.0);
+
+        /// returns `false` if metric name was too long to be rendered
+        bool is_valid() const { return m_prefix_len > 0; }
+        /// returns the name of the metric
+        METRIC_ID name() const { return m_name; }
+        /// returns the type of the metric
+        metric_type type() const { return m_type; }
+        /// returns the fraction of events which are sent to the server
+        double sample_rate() const { return m_rate; }
+        /// returns the pre-rendered "namespace.metric:" prefix
+        const char* prefix() const { return m_prefix; }
+        size_t prefix_len() const { return m_prefix_len; }
+        /// returns the pre-rendered type suffix, e.g. "|c"
+        const char* suffix() const { return m_suffix; }
+        size_t suffix_len() const { return m_suffix_len; }
+    };
+
+    /// counters describing the traffic generated by the client
+    struct client_stats
+    {
+        unsigned int datagrams; ///< number of datagrams sent to the server
+        unsigned int lines;     ///< number of metrics sent to the server
+        unsigned int queued;    ///< number of metrics waiting in async queue
+        unsigned int dropped;   ///< number of metrics dropped due to full async queue
+
+        /// returns the average number of metrics per datagram
+        double lines_per_datagram() const {
+            return datagrams ? lines / (double)datagrams : 0;
+        }
+    };
+
+    /// returns the counters for traffic generated by the client so far
+    client_stats get_client_stats();
+
+    /**
+    * Sends all the metrics which are waiting in batch buffers, aggregation
+    * tables or async queue. Does nothing if batching, aggregation and async
+    * sending are turned off. Call this before shutting down to make sure
+    * that no metric is left behind.
+    * @see client_config::set_batching
+    * @see client_config::set_aggregation
+    * @see client_config::set_async
+    */
+    void flush();
+
     /**
      * Provides automatic timing.
      * When you create an instance, it will note the current time. Then in the
@@ -213,13 +510,23 @@ namespace metrics
     {
         timer::time_point m_started_at;
         METRIC_ID m_metric;
+        const handle* m_handle;
+        timer_unit m_unit;
 
     public:
         /**
             constructs an auto_timer.
             @param metric The name of the metric to be stored
+            @param unit Unit in which the time is reported. Default is ms.
+        */
+        explicit auto_timer(METRIC_ID metric, timer_unit unit = milliseconds);
+        /**
+            constructs an auto_timer which stores the time through a handle.
+            @param h Handle of the histogram metric, must outlive the timer.
+                     Unit is determined by the handle type (histogram,
+                     timer_us or timer_ns).
         */
-        explicit auto_timer(METRIC_ID metric);
+        explicit auto_timer(const handle& h);
         ~auto_timer();
 
     private:
@@ -232,6 +539,9 @@ namespace metrics
     *
     *  @param metric The name of the counter to be incremented
     *  @param inc Amount by which to increment the counter. Default value is 1.
+    *  @param sample_rate Fraction of calls which are sent to the server, in
+    *         range (0,1]. Server scales the counter by 1/sample_rate. Ignored
+    *         when client aggregates counters. Default value is 1.
     *
     * ~~~ {.cpp}
     * void on_login(const char* user) {
@@ -240,16 +550,20 @@ namespace metrics
     *        metrics::inc("app.logins.failed");
     *        ...
     *     }
+    *     metrics::inc("app.logins.sampled", 1, 0.1); // only every 10th call is sent
     * }
     * ~~~
     */
-    void inc(METRIC_ID metric, int inc = 1);
+    void inc(METRIC_ID metric, int inc = 1, double sample_rate = 1.0);
 
     /**
     *  Sets the specified timer/histogram metric
     *
     *  @param metric The name of the timer/histogram to be updated
     *  @param value Amount to which metric will be set.
+    *  @param sample_rate Fraction of calls which are sent to the server, in
+    *         range (0,1]. Server scales the timer count by 1/sample_rate.
+    *         Default value is 1.
     *
     * ~~~ {.cpp}
     * void on_login(const char* user) {
@@ -264,7 +578,7 @@ namespace metrics
     *
     * @see auto_timer
     */
-    void measure(METRIC_ID metric, int value);
+    void measure(METRIC_ID metric, int value, double sample_rate = 1.0);
 
     /**
     *  Sets the specified gauge metric
@@ -296,12 +610,45 @@ namespace metrics
     * ~~~
     */
     void set_delta(METRIC_ID metric, int value);
+
+    /**
+    *  Increments the counter metric specified by handle
+    *  @param h Handle of the counter metric
+    *  @param inc Amount by which to increment the counter. Default value is 1.
+    *  @see handle
+    */
+    void inc(const handle& h, int inc = 1);
+
+    /**
+    *  Sets the timer/histogram metric specified by handle
+    *  @param h Handle of the histogram, timer_us or timer_ns metric
+    *  @param value Amount to which metric will be set.
+    *  @see handle
+    */
+    void measure(const handle& h, int value);
+
+    /**
+    *  Sets the gauge metric specified by handle
+    *  @param h Handle of the gauge metric
+    *  @param value Amount to which the gauge will be set.
+    *  @see handle
+    */
+    void set(const handle& h, unsigned int value);
+
+    /**
+    *  Sets the delta for gauge metric specified by handle
+    *  @param h Handle of the gauge metric
+    *  @param value Amount to be added to the the gauge.
+    *  @see handle
+    */
+    void set_delta(const handle& h, int value);
 }
 
 
 /**
 * Convenience macro to create an auto_timer with metric name set to
-* 'app.fn.function_name'
+* 'app.fn.function_name'. The name is sent with the namespace configured at
+* the time of the call.
 *
 *  ~~~ {.cpp}
 *  void some_function() {
@@ -312,3 +659,9 @@ namespace metrics
 */
 #define MEASURE_FN() metrics::auto_timer m_at__("app.fn."__FUNCTION__)
 
+/**
+* Same as MEASURE_FN(), but the time is reported in microseconds. Use it for
+* functions which take less than a few milliseconds.
+*/
+#define MEASURE_FN_US() metrics::auto_timer m_at__("app.fn."__FUNCTION__, metrics::microseconds)
+
@@ -1,13 +1,30 @@
 #include "stdafx.h"
 #include "metrics_server.h"
+#include "metric_record.h"
+#include "shared_memory.h"
+#include "sync.h"
+#include "worker_pool.h"
+#include "backend_worker.h"
 #include <memory>
+#include <climits>
+#include <algorithm>
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#include <intrin.h>
+#endif
 
 namespace metrics
 {
-    storage g_storage;
-
     server_config::server_config(unsigned int port) :
         m_port(port),
+        m_inproc_queue_size(0),
+        m_shm_max_clients(0),
+        m_socket_buffer_size(0),
+        m_recv_count(64),
+        m_recv_size(4096),
+        m_receiver_threads(0),
+        m_histogram_precision(7),
+        m_flush_threads(0),
         m_callback([]{}), // NOP callback
         m_flush_period(60)
     {
@@ -27,179 +44,986 @@ namespace metrics
         return *this;
     }
 
+    server_config& server_config::enable_inproc(unsigned int queue_size)
+    {
+        if (queue_size < 16 || queue_size > 1048576) throw config_exception("Valid queue size is 16-1048576");
+        m_inproc_queue_size = queue_size;
+        return *this;
+    }
+
+    server_config& server_config::enable_shared_memory(unsigned int max_clients)
+    {
+        if (max_clients < 1 || max_clients > 4096) throw config_exception("Valid number of clients is 1-4096");
+        m_shm_max_clients = max_clients;
+        return *this;
+    }
+
+    server_config& server_config::set_socket_buffer_size(unsigned int bytes)
+    {
+        if (bytes != 0 && (bytes < 4096 || bytes > 268435456)) throw config_exception("Valid socket buffer size is 0 or 4096-268435456 bytes");
+        m_socket_buffer_size = bytes;
+        return *this;
+    }
+
+    server_config& server_config::set_receive_batch(unsigned int count, unsigned int size)
+    {
+        if (count < 1 || count > 1024) throw config_exception("Valid number of receive buffers is 1-1024");
+        if (size < 512 || size > 65536) throw config_exception("Valid receive buffer size is 512-65536 bytes");
+        m_recv_count = count;
+        m_recv_size = size;
+        return *this;
+    }
+
+    server_config& server_config::receiver_threads(unsigned int n)
+    {
+        if (n > 64) throw config_exception("Valid number of receiver threads is 0-64");
+        m_receiver_threads = n;
+        return *this;
+    }
+
+    server_config& server_config::set_histogram_precision(unsigned int significant_digits)
+    {
+        if (significant_digits < 1 || significant_digits > 3) throw config_exception("Valid histogram precision is 1-3 digits");
+        const unsigned int bits[] = { 0, 4, 7, 10 }; // 2^-bits <= 10^-digits
+        m_histogram_precision = bits[significant_digits];
+        return *this;
+    }
+
+    server_config& server_config::add_backend(BACKEND_FN backend_instance, const backend_options& options)
+    {
+        if (options.queue_size < 1 || options.queue_size > 1024) throw config_exception("Valid backend queue size is 1-1024");
+
+        backend_entry entry = { backend_instance, options };
+        if (entry.options.name.empty()) {
+            char name[32];
+            sprintf_s(name, "backend%u", (unsigned int)m_backends.size());
+            entry.options.name = name;
+        }
+        m_backends.push_back(entry);
+        return *this;
+    }
+
+    server_config& server_config::flush_threads(unsigned int n)
+    {
+        if (n > 64) throw config_exception("Valid number of flush threads is 0-64");
+        m_flush_threads = n;
+        return *this;
+    }
+
+    server_config& server_config::listen_udp(unsigned int port)
+    {
+        if (port < 1 || port > 65535) throw config_exception("Valid port is 1-65535");
+        m_udp_ports.push_back(port);
+        return *this;
+    }
+
+    server_config& server_config::listen_tcp(unsigned int port)
+    {
+        if (port < 1 || port > 65535) throw config_exception("Valid port is 1-65535");
+        m_tcp_ports.push_back(port);
+        return *this;
+    }
+
     server_config& server_config::add_server_listener(SERVER_NOTIFICATION_FN callback)
     {
         m_server_cbs.push_back(callback);
         return *this;
     }
 
-    timer_data process_timer(const std::string& name, const std::vector<int>& values)
+    size_t series_columns::find(unsigned int series_id) const
     {
-        timer_data data = { name, values.size(), 0, 0, 0, 0, 0 };   
-        if (data.count == 0) return data;
+        auto it = std::lower_bound(series.begin(), series.end(), series_id);
+        return it != series.end() && *it == series_id ? it - series.begin() : npos;
+    }
 
-        data.min = values[0];
-        data.max = data.min;
-        long long square_sum = 0;  // needed for stddev
-        FOR_EACH (auto& v, values)
-        {
-            if (v > data.max) data.max = v;
-            if (v < data.min) data.min = v;
-            data.sum += v;
-            square_sum += v * v;
-        }
+    void timer_columns::resize(size_t rows)
+    {
+        series.resize(rows);
+        count.resize(rows);
+        min.resize(rows);
+        max.resize(rows);
+        sum.resize(rows);
+        avg.resize(rows);
+        stddev.resize(rows);
+        p50.resize(rows);
+        p90.resize(rows);
+        p99.resize(rows);
+        p999.resize(rows);
+    }
 
-        data.avg = data.sum / (double)data.count;
-        double var = square_sum / (double)data.count - data.avg * data.avg;
-        data.stddev = sqrt(var);
+    timer_data stats::timer_row(size_t row) const
+    {
+        const timer_columns& t = timers;
+        timer_data data = { name(t.series[row]), t.count[row], t.max[row], t.min[row], t.sum[row],
+            t.avg[row], t.stddev[row], t.p50[row], t.p90[row], t.p99[row], t.p999[row] };
         return data;
     }
 
-    stats flush_metrics(const storage& storage, unsigned int period_ms)
+    void process_timer(const timer_samples& samples, timer_columns& t, size_t row)
+    {
+        const sample_histogram& values = samples.values;
+        t.count[row] = (int)(samples.count + 0.5);
+        if (values.empty()) {
+            t.min[row] = t.max[row] = t.p50[row] = t.p90[row] = t.p99[row] = t.p999[row] = 0;
+            t.sum[row] = 0;
+            t.avg[row] = t.stddev[row] = 0;
+            return;
+        }
+
+        const running_stats& stats = values.stats();
+        t.min[row] = stats.min;
+        t.max[row] = stats.max;
+        t.sum[row] = stats.sum;
+
+        // avg and stddev are based on received samples, not on scaled count
+        t.avg[row] = stats.mean;
+        t.stddev[row] = sqrt(stats.variance());
+
+        const double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+        int percentiles[4];
+        values.quantiles(fractions, percentiles, 4);
+        t.p50[row] = percentiles[0];
+        t.p90[row] = percentiles[1];
+        t.p99[row] = percentiles[2];
+        t.p999[row] = percentiles[3];
+    }
+
+    typedef std::pair<unsigned int, unsigned int> series_row; // series id, id in storage
+
+    /**
+    * Finds series ids for storage `ids` and returns them sorted by series id.
+    * Names which were not flushed before are added to `series`. If a
+    * snapshot still refers to the table, it is copied first, so published
+    * tables never change.
+    */
+    std::vector<series_row> map_series(const name_table& names, const std::vector<unsigned int>& ids, std::shared_ptr<name_table>& series)
+    {
+        std::vector<series_row> rows(ids.size());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            const char* name = names.name(ids[i]);
+            size_t len = names.length(ids[i]);
+            unsigned int id = series->find(name, len);
+            if (id == name_table::npos) {
+                if (!series.unique()) series = std::make_shared<name_table>(*series);
+                id = series->intern(name, len);
+            }
+            rows[i] = series_row(id, ids[i]);
+        }
+        std::sort(rows.begin(), rows.end());
+        return rows;
+    }
+
+    // timers aggregated by one task of the flush worker pool
+    const size_t timers_per_part = 256;
+
+    /**
+    * Builds flush statistics from storage. Timers are aggregated by `pool`
+    * in parts of consecutive rows, each part writing to its own rows of the
+    * preallocated columns. `series` is the table of names shared with
+    * previous snapshots.
+    */
+    stats flush_metrics(const storage& storage, unsigned int period_ms, worker_pool& pool, std::shared_ptr<name_table>& series)
     {
         stats stats;
         stats.timestamp = timer::now();
 
         auto period =  period_ms / 1000.0;
 
-        FOR_EACH (auto& c, storage.counters) stats.counters[c.first] = c.second / period;
-        FOR_EACH (auto& g, storage.gauges) stats.gauges[g.first] = g.second;
-        FOR_EACH (auto& t, storage.timers) stats.timers[t.first] = process_timer(t.first, t.second);
+        const name_table& names = storage.names;
+        auto counter_rows = map_series(names, storage.counter_ids, series);
+        auto gauge_rows = map_series(names, storage.gauge_ids, series);
+        auto timer_rows = map_series(names, storage.timer_ids, series);
+        stats.names = series;
 
-        return stats; // todo: move
-    }
+        counter_columns& c = stats.counters;
+        c.series.reserve(counter_rows.size());
+        c.values.reserve(counter_rows.size());
+        FOR_EACH (auto& row, counter_rows) {
+            c.series.push_back(row.first);
+            c.values.push_back(storage.counters[row.second] / period);
+        }
 
-    void process_metric(storage* storage, char* buff, size_t len)
-    {
-        auto pipe_pos = strrchr(buff, '|');
-        auto colon_pos = strrchr(buff, ':');
-        if (!colon_pos || !pipe_pos) {
-            dbg_print("unknown metric: %s", buff);
-            return;
+        gauge_columns& g = stats.gauges;
+        g.series.reserve(gauge_rows.size());
+        g.values.reserve(gauge_rows.size());
+        FOR_EACH (auto& row, gauge_rows) {
+            g.series.push_back(row.first);
+            g.values.push_back(storage.gauges[row.second].value);
         }
 
-        metric_type metric;
-        if (strcmp(pipe_pos, "|h") == 0) metric = histogram;
-        else if (strcmp(pipe_pos, "|c") == 0) metric = counter;
-        else if (strcmp(pipe_pos, "|ms") == 0) metric = histogram;
-        else if (strcmp(pipe_pos, "|g") == 0) { // abs or delta?
-            char sign = *(colon_pos + 1);
-            metric = (sign == '+' || sign == '-') ? gauge_delta : gauge;
-        }
-        else {
-            dbg_print("unknown metric type: %s", pipe_pos);
-            return;
+        // folding allocates buckets from the storage arena, which is not
+        // thread-safe, so it is done here rather than by the pool
+        FOR_EACH (auto& row, timer_rows) {
+            storage.timers[row.second].values.fold_pending();
         }
 
-        *pipe_pos = '\0';
-        *colon_pos = '\0';
-        colon_pos++;
-        std::string metric_name = buff;
-        int value = atol(colon_pos);
+        timer_columns& t = stats.timers;
+        t.resize(timer_rows.size());
+        unsigned int parts = (unsigned int)((timer_rows.size() + timers_per_part - 1) / timers_per_part);
+        pool.run(parts, [&](unsigned int part) {
+            size_t end = (part + 1) * timers_per_part;
+            if (end > timer_rows.size()) end = timer_rows.size();
+            for (size_t i = part * timers_per_part; i < end; ++i) {
+                t.series[i] = timer_rows[i].first;
+                process_timer(storage.timers[timer_rows[i].second], t, i);
+            }
+        });
 
-        dbg_print("storing metric %d: %s [%d]", metric, metric_name.c_str(), value);
+        return stats;
+    }
 
+    /**
+    * Adds metrics from a shard to `to`. Counters are summed and timer
+    * samples combined. For gauges, the latest absolute value wins, and
+    * deltas from shards which didn't receive an absolute value are added.
+    */
+    void merge_storage(storage& to, const storage& from)
+    {
+        const name_table& names = from.names;
+        auto id_in = [&](unsigned int id) { return to.names.intern(names.name(id), names.length(id)); };
+
+        FOR_EACH (auto id, from.counter_ids) to.counter(id_in(id)) += from.counters[id];
+        FOR_EACH (auto id, from.gauge_ids) {
+            const gauge_value& g = from.gauges[id];
+            gauge_value& target = to.gauge(id_in(id));
+            if (g.set_at > target.set_at) {
+                target.value = target.set_at ? g.value : target.value + g.value;
+                target.set_at = g.set_at;
+            }
+            else if (!g.set_at) target.value += g.value;
+        }
+        FOR_EACH (auto id, from.timer_ids) {
+            const timer_samples& samples = from.timers[id];
+            timer_samples& target = to.timer(id_in(id));
+            target.values.merge(samples.values);
+            target.count += samples.count;
+        }
+    }
+
+    // backends have no notion of units, so timers in microseconds and
+    // nanoseconds are kept as separate series "<name>.us" and "<name>.ns".
+    // samples in different units are never mixed in one histogram
+    void store_metric(storage* storage, const char* name, size_t name_len, metric_type metric, int value, double rate)
+    {
+        char tagged[256];
+        if (metric == timer_us || metric == timer_ns) {
+            if (name_len + 3 >= sizeof(tagged)) {
+                dbg_print("timer name too long: %.*s", (int)name_len, name);
+                return;
+            }
+            memcpy(tagged, name, name_len);
+            memcpy(tagged + name_len, metric == timer_us ? ".us" : ".ns", 3);
+            name = tagged;
+            name_len += 3;
+        }
+
+        unsigned int id = storage->names.intern(name, name_len);
         switch (metric)
         {
             case metrics::counter:
-                storage->counters[metric_name] += value;
+                storage->counter(id) += value / rate;
                 break;
-            case metrics::gauge:
-                storage->gauges[metric_name] = value;
+            case metrics::gauge: {
+                gauge_value& g = storage->gauge(id);
+                g.value = value;
+                g.set_at = timer::now();
                 break;
+            }
             case metrics::gauge_delta:
-                storage->gauges[metric_name] += value;
+                storage->gauge(id).value += value;
                 break;
             case metrics::histogram:
-                storage->timers[metric_name].push_back(value);
+            case metrics::timer_us:
+            case metrics::timer_ns: {
+                timer_samples& samples = storage->timer(id);
+                samples.values.add(value);
+                samples.count += 1 / rate;
                 break;
+            }
+        }
+    }
+
+    // updates internal metrics after `count` metrics were stored
+    void mark_received(storage* storage, unsigned int count)
+    {
+        if (count == 0) return;
+        const size_t count_len = sizeof(builtin::internal_metrics_count) - 1;
+        const size_t last_seen_len = sizeof(builtin::internal_metrics_last_seen) - 1;
+        storage->counter(storage->names.intern(builtin::internal_metrics_count, count_len)) += count;
+        gauge_value& last_seen = storage->gauge(storage->names.intern(builtin::internal_metrics_last_seen, last_seen_len));
+        last_seen.set_at = timer::now();
+        last_seen.value = timer::to_ms(last_seen.set_at);
+    }
+
+    // returns the first occurrence of `c` in [p, end), or `end` if there is
+    // none. with SSE2, 16 characters are checked at once.
+    inline const char* find_char(const char* p, const char* end, char c)
+    {
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        const __m128i pattern = _mm_set1_epi8(c);
+        for (; end - p >= 16; p += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern));
+            if (mask) {
+                unsigned long index;
+                _BitScanForward(&index, mask);
+                return p + index;
+            }
+        }
+#endif
+        while (p < end && *p != c) ++p;
+        return p;
+    }
+
+    // parses "[0].digits" or "1[.0]" sample rate, optionally with an
+    // exponent like "1e-05", which clients formatting with %g send for
+    // small rates. returns 0 if invalid.
+    double parse_rate(const char* p, const char* end)
+    {
+        double rate = 0, scale = 1;
+        bool digits = false, fraction = false;
+        for (; p < end; ++p) {
+            if (*p == '.' && !fraction) { fraction = true; continue; }
+            if ((*p == 'e' || *p == 'E') && digits) break;
+            unsigned int d = (unsigned int)(*p - '0');
+            if (d > 9) return 0;
+            digits = true;
+            if (fraction) rate += d * (scale *= 0.1);
+            else rate = rate * 10 + d;
+        }
+        if (!digits) return 0;
+        if (p == end) return rate;
+
+        bool negative = ++p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) ++p;
+        if (p == end) return 0;
+        int exp = 0;
+        for (; p < end; ++p) {
+            unsigned int d = (unsigned int)(*p - '0');
+            if (d > 9) return 0;
+            if (exp < 400) exp = exp * 10 + d; // beyond the range of double anyway
+        }
+        for (int i = 0; i < exp; ++i) {
+            if (negative) rate /= 10;
+            else rate *= 10;
+        }
+        return rate;
+    }
+
+    // parses a single metric line "name:value|type[|@rate]" in one pass,
+    // without modifying or copying it. `line` is not null-terminated,
+    // `len` is the number of characters up to the line separator.
+    // returns `false` if line is not a valid metric.
+    bool process_metric(storage* storage, const char* line, size_t len)
+    {
+        const char* end = line + len;
+        if (len > 0 && *(end - 1) == '\r') --end;  // tolerate CRLF separators
+        int line_len = (int)(end - line);
+
+        // value is short, so the colon is found by scanning back from the pipe
+        const char* pipe_pos = find_char(line, end, '|');
+        const char* colon_pos = pipe_pos;
+        while (colon_pos > line && *(colon_pos - 1) != ':') --colon_pos;
+        if (pipe_pos == end || colon_pos <= line + 1) {
+            dbg_print("unknown metric: %.*s", line_len, line);
+            return false;
+        }
+        --colon_pos;
+
+        const char* p = colon_pos + 1;
+        bool has_sign = p < pipe_pos && (*p == '+' || *p == '-');
+        bool negative = has_sign && *p == '-';
+        if (has_sign) ++p;
+
+        long long value = 0;
+        const char* digits = p;
+        for (; p < pipe_pos; ++p) {
+            unsigned int d = (unsigned int)(*p - '0');
+            if (d > 9) break; // fraction is truncated
+            if (value <= INT_MAX) value = value * 10 + d;
+        }
+        if (p == digits) {
+            dbg_print("invalid value in metric: %.*s", line_len, line);
+            return false;
+        }
+        if (value > INT_MAX) value = INT_MAX; // saturate, like atol
+        if (negative) value = -value;
+
+        const char* type = pipe_pos + 1;
+        const char* type_end = type;
+        while (type_end < end && *type_end != '|') ++type_end;
+
+        metric_type metric;
+        bool known = true;
+        if (type_end - type == 1) {
+            switch (*type) {
+            case 'c': metric = counter; break;
+            case 'h': metric = histogram; break;
+            case 'g': metric = has_sign ? gauge_delta : gauge; break; // abs or delta?
+            default: known = false;
+            }
+        }
+        else if (type_end - type == 2 && type[1] == 's') {
+            switch (*type) {
+            case 'm': metric = histogram; break;
+            case 'u': metric = timer_us; break;
+            case 'n': metric = timer_ns; break;
+            default: known = false;
+            }
+        }
+        else known = false;
+
+        if (!known) {
+            dbg_print("unknown metric type: %.*s", line_len, line);
+            return false;
+        }
+
+        double rate = 1.0;
+        if (type_end + 1 < end && type_end[1] == '@') {
+            rate = parse_rate(type_end + 2, end);
+            if (!(rate > 0 && rate <= 1.0)) {
+                dbg_print("invalid sample rate in metric: %.*s", line_len, line);
+                rate = 1.0;
+            }
+        }
+
+        store_metric(storage, line, colon_pos - line, metric, (int)value, rate);
+        return true;
+    }
+
+    // processes a datagram which contains one or more newline separated metrics
+    void process_packet(storage* storage, const char* buff, size_t len)
+    {
+        const char* end = buff + len;
+        const char* line = buff;
+        unsigned int count = 0;
+
+        while (line < end) {
+            const char* eol = find_char(line, end, '\n');
+            if (eol > line && process_metric(storage, line, eol - line)) ++count;
+            line = eol + 1;
+        }
+
+        mark_received(storage, count);
+    }
+
+    // stores all metrics pushed by in-process or shared memory clients. a
+    // shared memory record is written by another process, so it is checked
+    // like a packet before use
+    void process_inproc(storage* storage, record_queue* queue)
+    {
+        metric_record r;
+        unsigned int count = 0;
+
+        while (queue->pop(r)) {
+            r.name[_countof(r.name) - 1] = '\0';
+            if ((unsigned int)r.type > (unsigned int)timer_ns || !(r.rate > 0.0f && r.rate <= 1.0f)) {
+                dbg_print("invalid metric record: %s", r.name);
+                continue;
+            }
+            store_metric(storage, r.name, strlen(r.name), r.type, r.value, r.rate);
+            ++count;
+        }
+
+        mark_received(storage, count);
+    }
+
+    struct server_thread_params
+    {
+        server_config cfg;
+        record_queue* inproc;
+        volatile LONG* inproc_idle;
+        HANDLE inproc_event;
+        HANDLE stop_event;
+    };
+
+    enum socket_kind { udp_socket, tcp_listener, tcp_client };
+
+    struct server_socket
+    {
+        SOCKET fd;
+        socket_kind kind;
+        std::string pending; // incomplete line received from TCP client
+    };
+
+    const unsigned int max_batches_per_wakeup = 16; // then check stop and flush
+    const size_t max_pending_line = 65536;
+
+    /**
+    * Receives pending datagrams without blocking, up to `count` of them.
+    * Each buffer holds `size` bytes plus the terminating zero, datagram
+    * lengths are stored in `lengths`. Returns the number of received
+    * datagrams, if it is less than `count` the socket is drained.
+    */
+    unsigned int receive_batch(SOCKET fd, char* buffers, unsigned int count, unsigned int size, int* lengths)
+    {
+        SOCK_ADDR_IN remaddr;
+        unsigned int received = 0;
+        while (received < count) {
+            int addrlen = sizeof(remaddr);
+            char* buf = buffers + received * (size + 1);
+            int recvlen = recvfrom(fd, buf, size, 0, (sockaddr*)&remaddr, &addrlen);
+            if (recvlen > 0) {
+                buf[recvlen] = 0;
+                lengths[received++] = recvlen;
+                continue;
+            }
+
+            int err = WSAGetLastError();
+            if (recvlen == 0 || err == WSAEMSGSIZE || err == WSAECONNRESET) continue; // skip this one
+            if (err != WSAEWOULDBLOCK) dbg_print("recvfrom failed, error: %d", err);
+            break;
+        }
+        return received;
+    }
+
+    // opens a non-blocking UDP or TCP listener. if `ev` is specified, it is
+    // signalled when the socket has work.
+    SOCKET open_listener(const server_config& cfg, int type, unsigned int port, WSAEVENT ev)
+    {
+        SOCKET fd = socket(AF_INET, type, 0);
+        if (fd == INVALID_SOCKET) {
+            dbg_print("cannot create server socket: error: %d", WSAGetLastError());
+            return INVALID_SOCKET;
         }
 
-        storage->counters[builtin::internal_metrics_count]++;
-        storage->gauges[builtin::internal_metrics_last_seen] = timer::now();
+        SOCK_ADDR_IN myaddr(AF_INET, INADDR_ANY, port);
+        if (bind(fd, (struct sockaddr *)&myaddr, sizeof(myaddr)) == SOCKET_ERROR ||
+            (type == SOCK_STREAM && listen(fd, SOMAXCONN) == SOCKET_ERROR)) {
+            dbg_print("bind failed at port %d, error: %d", port, WSAGetLastError());
+            closesocket(fd);
+            return INVALID_SOCKET;
+        }
+
+        unsigned int rcvbuf = cfg.socket_buffer_size();
+        if (rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char*)&rcvbuf, sizeof(rcvbuf)) == SOCKET_ERROR) {
+            dbg_print("cannot set socket buffer size, error: %d", WSAGetLastError());
+        }
+
+        // socket is non-blocking, so it is drained until it would block
+        unsigned long nonblocking = 1;
+        int result = ev ? WSAEventSelect(fd, ev, type == SOCK_DGRAM ? FD_READ : FD_ACCEPT) 
+                        : ioctlsocket(fd, FIONBIO, &nonblocking);
+        if (result == SOCKET_ERROR) {
+            dbg_print("cannot set up socket events, error: %d", WSAGetLastError());
+            closesocket(fd);
+            return INVALID_SOCKET;
+        }
+
+        dbg_print("server listening at %s port %d", type == SOCK_DGRAM ? "UDP" : "TCP", port);
+        return fd;
+    }
+
+    // reads from TCP client and processes complete lines. returns the number
+    // of bytes received, 0 if connection is closed or -1 if there is no data.
+    int receive_stream(storage* storage, server_socket& s, char* buf, unsigned int size)
+    {
+        int len = recv(s.fd, buf, size, 0);
+        if (len == SOCKET_ERROR) return WSAGetLastError() == WSAEWOULDBLOCK ? -1 : 0;
+        if (len == 0) return 0;
+
+        s.pending.append(buf, len);
+        size_t eol = s.pending.rfind('\n');
+        if (eol != std::string::npos) {
+            process_packet(storage, s.pending.data(), eol);
+            s.pending.erase(0, eol + 1);
+        }
+        else if (s.pending.size() > max_pending_line) {
+            dbg_print("dropping too long line from TCP client");
+            s.pending.clear();
+        }
+        return len;
+    }
+
+    // storage shard filled by a dedicated receiver thread
+    struct receiver
+    {
+        critical_section lock;  // held while storing a batch, and while swapping at flush
+        storage shards[2];      // one is filled, the other one is being flushed
+        storage* active;
+        std::vector<SOCKET> fds;
+        const server_config* cfg;
+        HANDLE stop_event;
+        HANDLE thread;
+    };
+
+    DWORD WINAPI ReceiverProc(LPVOID params)
+    {
+        receiver* shard = static_cast<receiver*>(params);
+        unsigned int recv_count = shard->cfg->recv_count();
+        unsigned int recv_size = shard->cfg->recv_size();
+        std::vector<char> buffers(recv_count * (recv_size + 1));
+        std::vector<int> lengths(recv_count);
+
+        // all receivers wait on the same sockets, whoever wakes first drains them
+        fd_set rdset;
+        while (WaitForSingleObject(shard->stop_event, 0) != WAIT_OBJECT_0) {
+            FD_ZERO(&rdset);
+            FOR_EACH (auto fd, shard->fds) FD_SET(fd, &rdset);
+            timeval timeout = { 0, 100000 }; // stop is checked at least every 100 ms
+            if (select(0, &rdset, NULL, NULL, &timeout) <= 0) continue;
+
+            FOR_EACH (auto fd, shard->fds) {
+                if (!FD_ISSET(fd, &rdset)) continue;
+
+                unsigned int received, batches = 0;
+                do {
+                    received = receive_batch(fd, &buffers[0], recv_count, recv_size, &lengths[0]);
+                    if (!received) break;
+
+                    scoped_lock lock(shard->lock);
+                    for (unsigned int j = 0; j < received; ++j) {
+                        process_packet(shard->active, &buffers[j * (recv_size + 1)], lengths[j]);
+                    }
+                } while (received == recv_count && ++batches < max_batches_per_wakeup);
+            }
+        }
+        return 0;
+    }
+
+    // storage handed over from the server thread to the flush thread
+    struct flush_job
+    {
+        const server_config* cfg;
+        HANDLE start_event;             // set when storage is ready to be flushed
+        HANDLE idle_event;              // set while flush thread is not flushing
+        volatile LONG stop;
+        storage* full;                  // storage swapped out of ingestion
+        std::vector<storage*> shards;   // swapped out receiver shards, merged into `full`
+        unsigned int period_ms;         // time covered by `full`
+        volatile LONGLONG duration_us;  // duration of the last flush
+    };
+
+    // stores backend activity since the previous flush as internal metrics
+    void record_backend_metrics(storage* storage, backend_worker& worker, backend_worker::counters& counters)
+    {
+        worker.take_counters(counters);
+
+        std::string name = std::string(builtin::internal_backend) + "." + worker.options().name + ".";
+        size_t prefix_len = name.size();
+        auto store = [&](const char* suffix, metric_type type, int value) {
+            name.replace(prefix_len, std::string::npos, suffix);
+            store_metric(storage, name.c_str(), name.size(), type, value, 1.0);
+        };
+
+        FOR_EACH (auto us, counters.durations_us) store("duration", timer_us, us);
+        if (counters.dropped) store("dropped", counter, counters.dropped);
+        if (counters.failed) store("failed", counter, counters.failed);
+        if (counters.slow) store("slow", counter, counters.slow);
+    }
+
+    // aggregates swapped out storage and hands the stats over to backend
+    // workers, so the server thread can keep receiving metrics
+    DWORD WINAPI FlushProc(LPVOID params)
+    {
+        flush_job* job = static_cast<flush_job*>(params);
+        worker_pool pool(job->cfg->flush_thread_count());
+        std::shared_ptr<name_table> series = std::make_shared<name_table>();
+
+        std::vector<std::unique_ptr<backend_worker> > backends;
+        FOR_EACH (auto& backend, job->cfg->backends()) backends.push_back(std::unique_ptr<backend_worker>(new backend_worker(backend)));
+        backend_worker::counters counters;
+
+        while (WaitForSingleObject(job->start_event, INFINITE) == WAIT_OBJECT_0 && !job->stop) {
+            auto start = timer::now();
+            FOR_EACH (auto shard, job->shards) {
+                merge_storage(*job->full, *shard);
+                shard->clear();
+            }
+            FOR_EACH (auto& backend, backends) record_backend_metrics(job->full, *backend, counters);
+
+            std::shared_ptr<const stats> snapshot = std::make_shared<stats>(flush_metrics(*job->full, job->period_ms, pool, series));
+            job->full->clear();
+            FOR_EACH (auto& backend, backends) backend->post(snapshot);
+
+            InterlockedExchange64(&job->duration_us, timer::to_us(timer::since(start)));
+            dbg_print("flush took %lld us", job->duration_us);
+            SetEvent(job->idle_event);
+        }
+        return 0;
     }
 
     DWORD WINAPI ThreadProc(LPVOID params)
     {     
-        const int BUFSIZE = 4096;
-        std::unique_ptr<server_config> pcfg(static_cast<server_config*>(params));
+        std::unique_ptr<server_thread_params> pparams(static_cast<server_thread_params*>(params));
+        server_config* pcfg = &pparams->cfg;
+        record_queue* inproc = pparams->inproc;
 
-        int recvlen, fd;                // # bytes received, our socket
-        char buf[BUFSIZE];              // receive buffer 
+        unsigned int recv_count = pcfg->recv_count();
+        unsigned int recv_size = pcfg->recv_size();
+        std::vector<char> buffers(recv_count * (recv_size + 1)); // receive buffers
+        std::vector<int> lengths(recv_count);
 
-        if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) { // create a UDP socket
-            dbg_print("cannot create server socket: error: %d", WSAGetLastError());
+        // all sockets share one event, signalled sockets are found by WSAEnumNetworkEvents
+        WSAEVENT net_event = WSACreateEvent();
+        HANDLE flush_timer = CreateWaitableTimer(NULL, FALSE, NULL);
+        std::vector<server_socket> sockets;
+
+        // metrics are stored in one storage while the other one is flushed
+        storage storages[2];
+        storage* active = &storages[0];
+        storages[0].histogram_precision = storages[1].histogram_precision = pcfg->histogram_precision();
+        flush_job job;
+        job.cfg = pcfg;
+        job.start_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        job.idle_event = CreateEvent(NULL, TRUE, TRUE, NULL);
+        job.stop = 0;
+        job.duration_us = 0;
+        HANDLE flush_thread = NULL;
+
+        // with receiver threads, UDP sockets are not handled by this thread
+        bool use_receivers = pcfg->receiver_count() > 0;
+        HANDLE receivers_stop = use_receivers ? CreateEvent(NULL, TRUE, FALSE, NULL) : NULL;
+        std::vector<std::unique_ptr<receiver>> receivers;
+        std::vector<SOCKET> udp_fds;
+
+        auto close_all = [&] {
+            if (flush_thread) {
+                InterlockedExchange(&job.stop, 1);
+                SetEvent(job.start_event);
+                WaitForSingleObject(flush_thread, INFINITE);
+                CloseHandle(flush_thread);
+            }
+            if (job.start_event) CloseHandle(job.start_event);
+            if (job.idle_event) CloseHandle(job.idle_event);
+            if (receivers_stop) SetEvent(receivers_stop);
+            FOR_EACH (auto& r, receivers) {
+                WaitForSingleObject(r->thread, INFINITE);
+                CloseHandle(r->thread);
+            }
+            if (receivers_stop) CloseHandle(receivers_stop);
+            FOR_EACH (auto fd, udp_fds) closesocket(fd);
+            FOR_EACH (auto& s, sockets) closesocket(s.fd);
+            if (net_event != WSA_INVALID_EVENT) WSACloseEvent(net_event);
+            if (flush_timer) CloseHandle(flush_timer);
+        };
+        auto fail = [&] {
+            close_all();
             FOR_EACH(auto& cb, pcfg->server_cbs()) cb(StartupFailed);
             return 1;
+        };
+
+        if (net_event == WSA_INVALID_EVENT || !flush_timer || !job.start_event || !job.idle_event || 
+            (use_receivers && !receivers_stop)) {
+            dbg_print("cannot create server events, error: %d", GetLastError());
+            return fail();
         }
 
-        auto start = timer::now();         
-        SOCK_ADDR_IN myaddr(AF_INET, INADDR_ANY, pcfg->port());
+        std::vector<unsigned int> udp_ports(1, pcfg->port());
+        udp_ports.insert(udp_ports.end(), pcfg->udp_ports().begin(), pcfg->udp_ports().end());
+        FOR_EACH (auto port, udp_ports) {
+            server_socket s = { open_listener(*pcfg, SOCK_DGRAM, port, use_receivers ? NULL : net_event), udp_socket };
+            if (s.fd == INVALID_SOCKET) return fail();
+            if (use_receivers) udp_fds.push_back(s.fd);
+            else sockets.push_back(s);
+        }
+        FOR_EACH (auto port, pcfg->tcp_ports()) {
+            server_socket s = { open_listener(*pcfg, SOCK_STREAM, port, net_event), tcp_listener };
+            if (s.fd == INVALID_SOCKET) return fail();
+            sockets.push_back(s);
+        }
 
-        if (bind(fd, (struct sockaddr *)&myaddr, sizeof(myaddr)) < 0) {
-            dbg_print("bind failed, error: %d", WSAGetLastError());
-            closesocket(fd);       
-            FOR_EACH(auto& cb, pcfg->server_cbs()) cb(StartupFailed);
-            return 1;
+        LARGE_INTEGER due;
+        due.QuadPart = -(LONGLONG)pcfg->flush_period_ms() * 10000; // relative, in 100 ns units
+        if (!SetWaitableTimer(flush_timer, &due, pcfg->flush_period_ms(), NULL, NULL, FALSE)) {
+            dbg_print("cannot start flush timer, error: %d", GetLastError());
+            return fail();
+        }
+
+        for (unsigned int i = 0; i < pcfg->receiver_count(); ++i) {
+            std::unique_ptr<receiver> r(new receiver);
+            r->active = &r->shards[0];
+            r->shards[0].histogram_precision = r->shards[1].histogram_precision = pcfg->histogram_precision();
+            r->fds = udp_fds;
+            r->cfg = pcfg;
+            r->stop_event = receivers_stop;
+            r->thread = CreateThread(NULL, 0, ReceiverProc, r.get(), 0, NULL);
+            if (!r->thread) {
+                dbg_print("cannot start receiver thread, error: %d", GetLastError());
+                return fail();
+            }
+            receivers.push_back(std::move(r));
         }
 
-        dbg_print("inproc server listening at port %d", pcfg->port());
-        
-        int maxfd = fd;
-        fd_set static_rdset, rdset;
-        SOCK_ADDR_IN remaddr;  
-        int addrlen = sizeof(remaddr);  // length of addresses 
-        timeval timeout = { 0, 250000 };
+        flush_thread = CreateThread(NULL, 0, FlushProc, &job, 0, NULL);
+        if (!flush_thread) {
+            dbg_print("cannot start flush thread, error: %d", GetLastError());
+            return fail();
+        }
+        auto swapped_at = timer::now();
+
+        shm_server shm;
+        if (pcfg->shm_max_clients() > 0 && !shm.create(pcfg->port(), pcfg->shm_max_clients())) {
+            dbg_print("shared memory transport is not available");
+        }
+        auto drain = [&](record_queue* queue) { process_inproc(active, queue); };
+        auto shm_refreshed_at = timer::now();
 
-        FD_ZERO(&static_rdset);
-        FD_SET(fd, &static_rdset);
+        // lower index wins if several are signalled, so stop and flush are never starved.
+        // queues wake the server up only while it's idle, see wake_consumer()
+        std::vector<HANDLE> handles;
+        handles.push_back(pparams->stop_event);
+        handles.push_back(flush_timer);
+        handles.push_back(net_event);
+        if (inproc) handles.push_back(pparams->inproc_event);
+        if (shm.event()) handles.push_back(shm.event());
+        auto set_idle = [&](bool idle) {
+            if (inproc) InterlockedExchange(pparams->inproc_idle, idle ? 1 : 0);
+            shm.set_idle(idle);
+        };
 
         FOR_EACH(auto& cb, pcfg->server_cbs()) cb(Started);
         while (true) {
-            rdset = static_rdset;
-            select(maxfd + 1, &rdset, NULL, NULL, &timeout);
-
-            if (FD_ISSET(fd, &rdset)) {
-                recvlen = recvfrom(fd, buf, BUFSIZE, 0, (sockaddr*)&remaddr, &addrlen);
-                if (recvlen > 0 && recvlen < BUFSIZE) {
-                    buf[recvlen] = 0;
-                    if (strcmp(buf, "stop") == 0) {
-                        dbg_print(" > received STOP cmd, stopping server");
-                        closesocket(fd);
-                        FOR_EACH(auto& cb, pcfg->server_cbs()) cb(Stopped);
-                        return 0;
+            // records pushed after the last check see the flag and signal the event
+            set_idle(true);
+            DWORD timeout = INFINITE;
+            if ((inproc && !inproc->empty()) || shm.has_records()) timeout = 0;
+            else if (shm.event()) {
+                long long refresh_in = 1000 - timer::since_ms(shm_refreshed_at); // new clients are found by refresh()
+                timeout = refresh_in > 0 ? (DWORD)refresh_in : 0;
+            }
+            DWORD wait = WaitForMultipleObjects((DWORD)handles.size(), &handles[0], FALSE, timeout);
+            set_idle(false);
+
+            if (wait == WAIT_OBJECT_0) {
+                dbg_print(" > received STOP cmd, stopping server");
+                close_all();
+                FOR_EACH(auto& cb, pcfg->server_cbs()) cb(Stopped);
+                return 0;
+            }
+            else if (wait == WAIT_OBJECT_0 + 1) {
+                if (WaitForSingleObject(job.idle_event, 0) != WAIT_OBJECT_0) {
+                    // metrics stay in active storage and are flushed next time
+                    dbg_print("previous flush is still running, skipping flush");
+                    store_metric(active, builtin::internal_flush_overlaps, sizeof(builtin::internal_flush_overlaps) - 1, counter, 1, 1.0);
+                }
+                else {
+                    auto& flush_fn = pcfg->flush_fn();
+                    flush_fn();
+                    if (inproc) process_inproc(active, inproc); // metrics sent by flush_fn
+                    FOR_EACH (auto queue, shm.queues()) process_inproc(active, queue);
+                    if (job.duration_us) {
+                        store_metric(active, builtin::internal_flush_duration, sizeof(builtin::internal_flush_duration) - 1, gauge, (int)job.duration_us, 1.0);
+                    }
+
+                    // swap storages, flush thread takes over the full ones
+                    ResetEvent(job.idle_event);
+                    job.full = active;
+                    active = (active == &storages[0]) ? &storages[1] : &storages[0];
+                    job.shards.clear();
+                    FOR_EACH (auto& r, receivers) {
+                        scoped_lock lock(r->lock);
+                        job.shards.push_back(r->active);
+                        r->active = (r->active == &r->shards[0]) ? &r->shards[1] : &r->shards[0];
+                    }
+                    job.period_ms = (unsigned int)timer::since_ms(swapped_at);
+                    swapped_at = timer::now();
+                    SetEvent(job.start_event);
+                }
+            }
+            else if (wait == WAIT_OBJECT_0 + 2) {
+                WSAResetEvent(net_event); // before enumerating, so new events signal it again
+
+                size_t count = sockets.size(); // accepted clients are checked on next wakeup
+                for (size_t i = 0; i < count; ++i) {
+                    WSANETWORKEVENTS ne;
+                    if (WSAEnumNetworkEvents(sockets[i].fd, NULL, &ne) == SOCKET_ERROR) continue;
+
+                    if (ne.lNetworkEvents & FD_ACCEPT) {
+                        SOCKET client;
+                        while ((client = accept(sockets[i].fd, NULL, NULL)) != INVALID_SOCKET) {
+                            if (WSAEventSelect(client, net_event, FD_READ | FD_CLOSE) == SOCKET_ERROR) {
+                                closesocket(client);
+                                continue;
+                            }
+                            server_socket s = { client, tcp_client };
+                            sockets.push_back(s);
+                        }
+                    }
+
+                    if (ne.lNetworkEvents & FD_READ) {
+                        server_socket& s = sockets[i];
+                        if (s.kind == udp_socket) {
+                            unsigned int received, batches = 0;
+                            do { // FD_READ is posted again if datagrams are left
+                                received = receive_batch(s.fd, &buffers[0], recv_count, recv_size, &lengths[0]);
+                                for (unsigned int j = 0; j < received; ++j) {
+                                    char* buf = &buffers[j * (recv_size + 1)];
+                                    dbg_print(" > received:%s (%d bytes)", buf, lengths[j]);
+                                    process_packet(active, buf, lengths[j]);
+                                }
+                            } while (received == recv_count && ++batches < max_batches_per_wakeup);
+                        }
+                        else if (receive_stream(active, s, &buffers[0], recv_size) == 0) {
+                            ne.lNetworkEvents |= FD_CLOSE;
+                        }
                     }
-                    dbg_print(" > received:%s (%d bytes)", buf, recvlen);
-                    process_metric(&g_storage, buf, recvlen);
-                }                 
+
+                    if (ne.lNetworkEvents & FD_CLOSE) {
+                        server_socket& s = sockets[i];
+                        while (receive_stream(active, s, &buffers[0], recv_size) > 0);
+                        // last line doesn't need the newline
+                        process_packet(active, s.pending.data(), s.pending.size());
+                        closesocket(s.fd);
+                        s.fd = INVALID_SOCKET;
+                    }
+                }
+
+                for (size_t i = sockets.size(); i-- > 0;) {
+                    if (sockets[i].fd == INVALID_SOCKET) sockets.erase(sockets.begin() + i);
+                }
             }
+            else if (wait == WAIT_FAILED) {
+                dbg_print("server wait failed, error: %d", GetLastError());
+                Sleep(10);
+            }
+
+            if (inproc) process_inproc(active, inproc);
+            FOR_EACH (auto queue, shm.queues()) process_inproc(active, queue);
 
-            if (timer::since(start) >= pcfg->flush_period_ms())
-            {
-                start = timer::now();
-                auto& flush_fn = pcfg->flush_fn();
-                flush_fn();
-                stats stats = flush_metrics(g_storage, pcfg->flush_period_ms());
-                g_storage.clear();
-                FOR_EACH (auto& backend, pcfg->backends()) backend(stats);
-                dbg_print("flush took %d ms", timer::since(start));
+            if (timer::since_ms(shm_refreshed_at) >= 1000) {
+                shm_refreshed_at = timer::now();
+                shm.refresh(drain);
             }
         }
     }
 
     server server::run(const server_config& cfg)
     {
+        // queue and events are never freed, as clients and copies of server can use them at any time
+        record_queue* inproc = NULL;
+        volatile LONG* inproc_idle = NULL;
+        HANDLE inproc_event = NULL;
+        if (cfg.inproc_queue_size() > 0) {
+            inproc_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+            if (!inproc_event) throw std::runtime_error("Failed creating server inproc event");
+            inproc = new record_queue(cfg.inproc_queue_size());
+            inproc_idle = new LONG(0);
+        }
+
+        HANDLE stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!stop_event) throw std::runtime_error("Failed creating server stop event");
+
+        server_thread_params* params = new server_thread_params;
+        params->cfg = cfg;
+        params->inproc = inproc;
+        params->inproc_idle = inproc_idle;
+        params->inproc_event = inproc_event;
+        params->stop_event = stop_event;
+
         DWORD thread_id;
-        HANDLE h = CreateThread(NULL, 0, ThreadProc, new server_config(cfg), 0, &thread_id);
-        if (!h) throw std::runtime_error("Failed creating server thread");
+        HANDLE h = CreateThread(NULL, 0, ThreadProc, params, 0, &thread_id);
+        if (!h) {
+            delete params;
+            throw std::runtime_error("Failed creating server thread");
+        }
         dbg_print("started inproc server on thread %d", thread_id);
-        return server(cfg);
+        return server(cfg, inproc, inproc_idle, inproc_event, stop_event);
     }
 
     void server::stop()
     {
         dbg_print("sending stop cmd...");
-        const char* cmd = "stop";
-        send_to_server(cmd, strlen(cmd));
+        if (m_stop_event) SetEvent(m_stop_event);
     }
-}
\ No newline at end of file
+}
@@ -2,8 +2,11 @@
 
 #include <map>
 #include <vector>
+#include <memory>
 #include "metrics.h"
 #include "backends.h"
+#include "name_table.h"
+#include "histogram.h"
 #include <functional>
 
 namespace metrics
@@ -26,6 +29,42 @@ namespace metrics
     /// prototype for function called by server to broadcast notifications
     typedef std::function<void(server_events)> SERVER_NOTIFICATION_FN;
 
+    /// what happens to a snapshot when the queue of a backend is full
+    enum backend_overflow
+    {
+        drop_newest,    ///< the new snapshot is dropped, queued ones are kept
+        drop_oldest     ///< the oldest queued snapshot is dropped, so the backend catches up
+    };
+
+    /**
+    * Settings of a backend. Each backend is called on its own thread and
+    * receives snapshots through a bounded queue, so a slow backend delays
+    * neither other backends nor the next flush.
+    *
+    * Backend activity is reported as internal metrics
+    * `metrics.internal.backend.<name>.duration.us`, `.dropped`, `.failed`
+    * (backend threw an exception) and `.slow` (call took longer than
+    * `slow_ms`). Slow calls are only counted, they can't be interrupted.
+    */
+    struct backend_options
+    {
+        std::string name;           ///< used in internal metric names, generated if empty
+        unsigned int queue_size;    ///< snapshots waiting for the backend, [1,1024]
+        backend_overflow overflow;  ///< what happens when the queue is full
+        unsigned int slow_ms;       ///< calls taking longer are reported as slow, 0 turns it off
+
+        explicit backend_options(const char* name = "", unsigned int queue_size = 4,
+                                 backend_overflow overflow = drop_oldest, unsigned int slow_ms = 10000) :
+            name(name), queue_size(queue_size), overflow(overflow), slow_ms(slow_ms) { ; }
+    };
+
+    /// backend together with its settings
+    struct backend_entry
+    {
+        BACKEND_FN fn;
+        backend_options options;
+    };
+
 
     class server_config;
 
@@ -34,9 +73,19 @@ namespace metrics
     {
         unsigned int m_flush_period;
         unsigned int m_port;
+        unsigned int m_inproc_queue_size;
+        unsigned int m_shm_max_clients;
+        unsigned int m_socket_buffer_size;
+        unsigned int m_recv_count;
+        unsigned int m_recv_size;
+        unsigned int m_receiver_threads;
+        unsigned int m_histogram_precision;
+        unsigned int m_flush_threads;
+        std::vector<unsigned int> m_udp_ports;
+        std::vector<unsigned int> m_tcp_ports;
         FLUSH_FN m_callback;
         std::vector<SERVER_NOTIFICATION_FN> m_server_cbs;
-        std::vector<BACKEND_FN> m_backends;
+        std::vector<backend_entry> m_backends;
 
     public:
         /**
@@ -125,15 +174,35 @@ namespace metrics
         * }
         * ~~~
         *
+        * Backends are called on their own threads with default
+        * backend_options, see the other overload.
+        *
         * @see [Running the server](docs/running_server.md)
         * @see file_backend
         * @see console_backend
         */
         server_config& add_backend(BACKEND_FN backend_instance) {
-            m_backends.push_back(backend_instance); 
-            return *this;
+            return add_backend(backend_instance, backend_options());
         }
 
+        /**
+        * Adds a backend for flushed stats, with its own queue settings.
+        *
+        * @param backend_instance An instance of a backend, see above
+        * @param options Name, queue size, overflow policy and slow call limit of
+        *        the backend. Valid queue size is [1,1024]
+        *
+        * Example:
+        * ~~~{.cpp}
+        * auto cfg = metrics::server_config()
+        *     // a file on a slow disk only gets the latest stats
+        *     .add_backend(file_backend("stats.log"), backend_options("file", 1, drop_oldest))
+        *     // console keeps up to 16 snapshots and drops new ones when full
+        *     .add_backend(console_backend(), backend_options("console", 16, drop_newest));
+        * ~~~
+        */
+        server_config& add_backend(BACKEND_FN backend_instance, const backend_options& options);
+
         /**
         * Specifies the function to be called before the values are flushed.
         * You can use this to add some metrics, etc.
@@ -170,22 +239,192 @@ namespace metrics
         */
         server_config& add_server_listener(SERVER_NOTIFICATION_FN callback);
 
+        /**
+        * Lets the client in the same process send metrics directly to the
+        * server, without formatting, sockets or parsing. Client pushes parsed
+        * metrics into a lock-free queue, which is drained by the server
+        * thread. The server still listens on its UDP port for other clients.
+        *
+        * @param queue_size Capacity of the queue, rounded up to the power of
+        *                   2. The default is 65536, valid values are
+        *                   [16,1048576]
+        *
+        * Example:
+        * ~~~{.cpp}
+        * auto svr = metrics::server::run(metrics::server_config().enable_inproc());
+        * metrics::setup_client(svr);  // no UDP between client and server
+        * ~~~
+        *
+        * @see setup_client(const server&)
+        */
+        server_config& enable_inproc(unsigned int queue_size = 65536);
+
+        /**
+        * Lets clients in other processes on the same host send metrics through
+        * shared memory, without sockets or parsing. Each client creates its
+        * own queue in a named file mapping, and the server drains all of them.
+        * Clients opt in with client_config::use_shared_memory(), others keep
+        * using UDP.
+        *
+        * @param max_clients Maximum number of attached client processes. The
+        *                    default is 64, valid values are [1,4096]
+        *
+        * Example:
+        * ~~~{.cpp}
+        * // server process
+        * metrics::server::run(metrics::server_config(9999).enable_shared_memory());
+        *
+        * // client process
+        * metrics::setup_client("127.0.0.1", 9999).use_shared_memory();
+        * ~~~
+        */
+        server_config& enable_shared_memory(unsigned int max_clients = 64);
+
+        /**
+        * Sets the size of socket receive buffer (`SO_RCVBUF`). Datagrams
+        * which arrive while the buffer is full are dropped by the OS, so
+        * busy servers should use a larger buffer.
+        *
+        * @param bytes Buffer size in bytes. 0, the default, keeps the system
+        *              default, other valid values are [4096,268435456]
+        *
+        * Example:
+        * ~~~{.cpp}
+        * auto cfg = metrics::server_config(9999).set_socket_buffer_size(8 * 1024 * 1024);
+        * ~~~
+        */
+        server_config& set_socket_buffer_size(unsigned int bytes);
+
+        /**
+        * Sets how many datagrams the server receives on each wakeup before
+        * it processes them, and how large each datagram can be. Server keeps
+        * receiving batches until the socket is drained, checking for stop and
+        * flush after every 16 batches.
+        *
+        * @param count Number of receive buffers. The default is 64, valid
+        *              values are [1,1024]
+        * @param size Size of each buffer in bytes. Longer datagrams are
+        *             dropped. The default is 4096, valid values are
+        *             [512,65536]
+        *
+        * Example:
+        * ~~~{.cpp}
+        * // clients batch metrics in datagrams up to 8 KB
+        * auto cfg = metrics::server_config(9999).set_receive_batch(128, 8192);
+        * ~~~
+        */
+        server_config& set_receive_batch(unsigned int count = 64, unsigned int size = 4096);
+
+        /**
+        * Sets the number of threads which receive and parse UDP datagrams.
+        * Each thread stores metrics in its own shard, and shards are merged
+        * at flush: counters are summed, timer samples are combined and for
+        * gauges the last absolute value wins. By default, UDP datagrams are
+        * received by the server thread itself.
+        *
+        * @param n Number of receiver threads. Valid values are [0,64], 0
+        *          turns dedicated receivers off
+        *
+        * Example:
+        * ~~~{.cpp}
+        * SYSTEM_INFO si;
+        * GetSystemInfo(&si);
+        * auto cfg = metrics::server_config(9999).receiver_threads(si.dwNumberOfProcessors);
+        * ~~~
+        */
+        server_config& receiver_threads(unsigned int n);
+
+        /**
+        * Sets the precision of timer histograms. Timer samples are not kept,
+        * they are counted in buckets whose width grows with the value, so
+        * memory per timer is bounded. Reported percentiles are within the
+        * relative error given by the number of significant digits, while
+        * min, max, sum, avg and stddev are exact.
+        *
+        * @param significant_digits 1 for 10%, 2 for 1% and 3 for 0.1% error.
+        *                           The default is 2.
+        *
+        * Example:
+        * ~~~{.cpp}
+        * auto cfg = metrics::server_config(9999).set_histogram_precision(3);
+        * ~~~
+        */
+        server_config& set_histogram_precision(unsigned int significant_digits = 2);
+
+        /**
+        * Sets the number of additional threads which compute timer statistics
+        * at flush. Timers are split into parts which are aggregated in
+        * parallel by the flush thread and the workers. Worth enabling when
+        * there are many thousands of timers. By default, the flush thread
+        * aggregates all timers itself.
+        *
+        * @param n Number of flush worker threads. Valid values are [0,64]
+        *
+        * Example:
+        * ~~~{.cpp}
+        * SYSTEM_INFO si;
+        * GetSystemInfo(&si);
+        * auto cfg = metrics::server_config(9999).flush_threads(si.dwNumberOfProcessors - 1);
+        * ~~~
+        */
+        server_config& flush_threads(unsigned int n);
+
+        /**
+        * Adds another UDP port the server listens on, besides the one passed
+        * to the constructor.
+        * @param port UDP port
+        */
+        server_config& listen_udp(unsigned int port);
+
+        /**
+        * Makes the server accept TCP connections on the specified port.
+        * Clients send the same newline separated metrics as over UDP, and
+        * can keep the connection open. All listeners are served by the same
+        * server thread.
+        *
+        * @param port TCP port
+        *
+        * Example:
+        * ~~~{.cpp}
+        * auto cfg = metrics::server_config(9999)
+        *     .listen_udp(8125)   // also accept statsd default port
+        *     .listen_tcp(9999);  // and TCP clients
+        * ~~~
+        */
+        server_config& listen_tcp(unsigned int port);
+
         unsigned int flush_period_ms() const { return m_flush_period * 1000; }
         unsigned int port() const { return m_port; }
+        unsigned int inproc_queue_size() const { return m_inproc_queue_size; }
+        unsigned int shm_max_clients() const { return m_shm_max_clients; }
+        unsigned int socket_buffer_size() const { return m_socket_buffer_size; }
+        unsigned int recv_count() const { return m_recv_count; }
+        unsigned int recv_size() const { return m_recv_size; }
+        unsigned int receiver_count() const { return m_receiver_threads; }
+        /// returns the number of sub-bucket bits used by timer histograms
+        unsigned int histogram_precision() const { return m_histogram_precision; }
+        unsigned int flush_thread_count() const { return m_flush_threads; }
+        const std::vector<unsigned int>& udp_ports() const { return m_udp_ports; }
+        const std::vector<unsigned int>& tcp_ports() const { return m_tcp_ports; }
         const FLUSH_FN& flush_fn() const { return m_callback; }
         const std::vector<SERVER_NOTIFICATION_FN>& server_cbs() const { return m_server_cbs; }
-        const std::vector<BACKEND_FN>& backends() const { return m_backends; }
+        const std::vector<backend_entry>& backends() const { return m_backends; }
     };
 
     /// Represents a instance of the server.
     class server
     {
         server_config m_cfg;
-        server(const server_config& cfg) : m_cfg(cfg) { ; }
+        bounded_queue<metric_record>* m_inproc;
+        volatile LONG* m_inproc_idle;
+        HANDLE m_inproc_event;
+        HANDLE m_stop_event;
+        server(const server_config& cfg, bounded_queue<metric_record>* inproc, volatile LONG* inproc_idle, HANDLE inproc_event, HANDLE stop_event) : 
+            m_cfg(cfg), m_inproc(inproc), m_inproc_idle(inproc_idle), m_inproc_event(inproc_event), m_stop_event(stop_event) { ; }
 
     public:
         /// default ctor for cases where object must be instanitated in advance
-        server(){;}
+        server() : m_inproc(NULL), m_inproc_idle(NULL), m_inproc_event(NULL), m_stop_event(NULL) {;}
         /**
         * starts the server, based on specified configuration
         * @param cfg Setting used by the server
@@ -199,19 +438,83 @@ namespace metrics
         void stop();
 
         const server_config& config() const { return m_cfg; }
+
+        /// returns the queue for in-process client, NULL if not enabled
+        bounded_queue<metric_record>* inproc_queue() const { return m_inproc; }
+        /// returns the flag set while the server waits for in-process records, see wake_consumer()
+        volatile LONG* inproc_idle() const { return m_inproc_idle; }
+        /// returns the event which wakes up the server waiting for in-process records
+        HANDLE inproc_event() const { return m_inproc_event; }
     };
 
-    // storage for raw metric data. values are stored here until they are flushed
+    /// raw samples of a single timer
+    struct timer_samples
+    {
+        sample_histogram values; ///< received values
+        double count;            ///< number of events, scaled by sample rate
+
+        explicit timer_samples(unsigned int precision = 7, arena* buckets = NULL) : values(precision, buckets), count(0) { ; }
+    };
+
+    /// raw value of a single gauge
+    struct gauge_value
+    {
+        long long value;            ///< last absolute value plus later deltas
+        timer::time_point set_at;   ///< time of last absolute value, 0 if only deltas were received
+
+        gauge_value() : value(0), set_at(0) { ; }
+    };
+
+    // storage for raw metric data. values are stored here until they are flushed.
+    // values are kept in arrays indexed by name id, and only series updated
+    // since the last flush are reported. names and ids survive the flush.
+    // histogram buckets are allocated from an arena which is reset at flush,
+    // so timers which are not updated don't hold any memory.
     struct storage
     {
-        std::map<std::string, unsigned int> counters;
-        std::map<std::string, long long> gauges;
-        std::map<std::string, std::vector<int> > timers;
+        name_table names;
+        unsigned int histogram_precision;   // in bits, see sample_histogram
+        arena buckets;                      // for histograms of timers updated since last flush
+        std::vector<double> counters;       // scaled by sample rate
+        std::vector<gauge_value> gauges;
+        std::vector<timer_samples> timers;
+        std::vector<unsigned int> counter_ids; // series updated since last flush
+        std::vector<unsigned int> gauge_ids;
+        std::vector<unsigned int> timer_ids;
+
+        double& counter(unsigned int id) { return touch(id, 1, counter_ids, counters, 0.0); }
+        gauge_value& gauge(unsigned int id) { return touch(id, 2, gauge_ids, gauges, gauge_value()); }
+        timer_samples& timer(unsigned int id) { return touch(id, 4, timer_ids, timers, timer_samples(histogram_precision, &buckets)); }
+
+        storage() : histogram_precision(7) { ; }
 
         void clear() {
-            counters.clear();
-            gauges.clear();
-            timers.clear();
+            FOR_EACH (auto id, counter_ids) { counters[id] = 0; m_touched[id] = 0; }
+            FOR_EACH (auto id, gauge_ids) { gauges[id] = gauge_value(); m_touched[id] = 0; }
+            FOR_EACH (auto id, timer_ids) {
+                timers[id].values.release();
+                timers[id].count = 0;
+                m_touched[id] = 0;
+            }
+            counter_ids.clear();
+            gauge_ids.clear();
+            timer_ids.clear();
+            buckets.reset();
+        }
+
+    private:
+        std::vector<unsigned char> m_touched; // by id, bit per series type
+
+        template <typename T>
+        T& touch(unsigned int id, unsigned char bit, std::vector<unsigned int>& ids, std::vector<T>& values, const T& empty) {
+            if (id >= values.size()) values.resize(names.size(), empty);
+            if (id >= m_touched.size()) m_touched.resize(names.size(), 0);
+
+            if (!(m_touched[id] & bit)) {
+                m_touched[id] |= bit;
+                ids.push_back(id);
+            }
+            return values[id];
         }
     };
 
@@ -219,30 +522,104 @@ namespace metrics
     struct timer_data
     {
         std::string metric; ///< name of the timer
-        int count;          ///< number of entries
+        int count;          ///< number of events, scaled by sample rate
         int max;            ///< maximum value of the measured sample
         int min;            ///< minimum value of the measured sample
         long long sum;      ///< sum of all sampled values
         double avg;         ///< average (mean) of samples
         double stddev;      ///< standard deviation
+        int p50;            ///< median
+        int p90;            ///< 90th percentile
+        int p99;            ///< 99th percentile
+        int p999;           ///< 99.9th percentile
 
         /// returns a string with textual description of timer data
         std::string dump() const
         {
             char txt[256];
             _snprintf_s(txt, _countof(txt), _TRUNCATE, 
-                "%s - cnt: %d, min: %d, max: %d, sum: %lld, avg: %.2f, stddev: %.2f",
-                metric.c_str(), count, min, max, sum, avg, stddev);
+                "%s - cnt: %d, min: %d, max: %d, sum: %lld, avg: %.2f, stddev: %.2f, "
+                "p50: %d, p90: %d, p99: %d, p999: %d",
+                metric.c_str(), count, min, max, sum, avg, stddev, p50, p90, p99, p999);
             return txt;
         }
     };
 
-    /// contains processed metric statistics
+    /// series ids of the rows in stats columns, in ascending order
+    struct series_columns
+    {
+        static const size_t npos = (size_t)-1;
+
+        std::vector<unsigned int> series;   ///< series id of each row
+
+        /// returns the number of rows
+        size_t size() const { return series.size(); }
+
+        /// returns the row of the series, or `npos` if it is not present
+        size_t find(unsigned int series_id) const;
+    };
+
+    /// counter values, one row per counter updated during the flush period
+    struct counter_columns : series_columns
+    {
+        std::vector<double> values;         ///< events per second
+    };
+
+    /// gauge values, one row per gauge updated during the flush period
+    struct gauge_columns : series_columns
+    {
+        std::vector<long long> values;      ///< last value
+    };
+
+    /// timer statistics, one row per timer updated during the flush period.
+    /// see timer_data for the meaning of the columns
+    struct timer_columns : series_columns
+    {
+        std::vector<int> count;
+        std::vector<int> min;
+        std::vector<int> max;
+        std::vector<long long> sum;
+        std::vector<double> avg;
+        std::vector<double> stddev;
+        std::vector<int> p50;
+        std::vector<int> p90;
+        std::vector<int> p99;
+        std::vector<int> p999;
+
+        /// sets the number of rows of all columns
+        void resize(size_t rows);
+    };
+
+    /**
+    * Contains processed metric statistics of a single flush. Values are
+    * stored by columns, one array per statistic, and rows are identified by
+    * series id. Names of series are kept in a table shared by consecutive
+    * snapshots, which only grows, so a series has the same id in all of
+    * them. Copying stats copies just the arrays, so snapshots are cheap to
+    * keep as a baseline or history.
+    *
+    * Example:
+    * ~~~{.cpp}
+    * void print_p99(const stats& stats) {
+    *     const timer_columns& t = stats.timers;
+    *     for (size_t i = 0; i < t.size(); ++i) {
+    *         printf("%s: %d\n", stats.name(t.series[i]), t.p99[i]);
+    *     }
+    * }
+    * ~~~
+    */
     struct stats
     {
         timer::time_point timestamp;
-        std::map<std::string, double> counters; ///< counter data
-        std::map<std::string, long long> gauges; ///< gauge data
-        std::map<std::string, timer_data> timers; ///< timer data
+        std::shared_ptr<const name_table> names; ///< names of series, indexed by series id
+        counter_columns counters; ///< counter data
+        gauge_columns gauges;     ///< gauge data
+        timer_columns timers;     ///< timer data
+
+        /// returns the name of the series
+        const char* name(unsigned int series) const { return names->name(series); }
+
+        /// returns the statistics of timer at the specified row
+        timer_data timer_row(size_t row) const;
     };
 }
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include "stdafx.h"
+#include "name_table.h"
+#include <string.h>
+
+namespace metrics
+{
+    const unsigned int initial_slots = 1024;
+
+    name_table::name_table() : m_offsets(1, 0)
+    {
+        slot empty = { 0, npos };
+        m_slots.assign(initial_slots, empty);
+    }
+
+    unsigned int name_table::find(const char* name, size_t len) const
+    {
+        unsigned int h = hash(name, len);
+        unsigned int mask = (unsigned int)m_slots.size() - 1;
+        for (unsigned int i = h & mask;; i = (i + 1) & mask) {
+            const slot& s = m_slots[i];
+            if (s.id == npos) return npos;
+            if (s.hash == h && length(s.id) == len && memcmp(this->name(s.id), name, len) == 0) return s.id;
+        }
+    }
+
+    unsigned int name_table::intern(const char* name, size_t len)
+    {
+        unsigned int h = hash(name, len);
+        unsigned int mask = (unsigned int)m_slots.size() - 1;
+        unsigned int i = h & mask;
+        for (;; i = (i + 1) & mask) {
+            const slot& s = m_slots[i];
+            if (s.id == npos) break;
+            if (s.hash == h && length(s.id) == len && memcmp(this->name(s.id), name, len) == 0) return s.id;
+        }
+
+        unsigned int id = size();
+        m_chars.insert(m_chars.end(), name, name + len);
+        m_chars.push_back('\0');
+        m_offsets.push_back((unsigned int)m_chars.size());
+        m_hashes.push_back(h);
+
+        m_slots[i].hash = h;
+        m_slots[i].id = id;
+        if (size() * 2 > m_slots.size()) grow();
+        return id;
+    }
+
+    void name_table::grow()
+    {
+        slot empty = { 0, npos };
+        m_slots.assign(m_slots.size() * 2, empty);
+
+        unsigned int mask = (unsigned int)m_slots.size() - 1;
+        for (unsigned int id = 0; id < size(); ++id) {
+            unsigned int i = m_hashes[id] & mask;
+            while (m_slots[i].id != npos) i = (i + 1) & mask;
+            m_slots[i].hash = m_hashes[id];
+            m_slots[i].id = id;
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+
+namespace metrics
+{
+    /**
+    * Interns metric names. Each name is copied and hashed only once, and
+    * gets a dense id which stays valid for the lifetime of the table, so
+    * per-metric data can be kept in plain arrays indexed by id.
+    *
+    * Lookup uses an open-addressing hash table with linear probing. Slots
+    * keep the precomputed hash, so names are compared only on hash match.
+    */
+    class name_table
+    {
+        struct slot
+        {
+            unsigned int hash;
+            unsigned int id;    // npos if slot is empty
+        };
+
+        std::vector<slot> m_slots;          // power of 2, at most half full
+        std::vector<unsigned int> m_hashes; // by id
+        std::vector<unsigned int> m_offsets;// by id, start of name in m_chars, plus end sentinel
+        std::vector<char> m_chars;          // null-terminated names
+
+        void grow();
+
+    public:
+        static const unsigned int npos = 0xFFFFFFFF;
+
+        name_table();
+
+        /// returns FNV-1a hash of the name
+        static unsigned int hash(const char* name, size_t len)
+        {
+            unsigned int h = 2166136261u;
+            for (size_t i = 0; i < len; ++i) h = (h ^ (unsigned char)name[i]) * 16777619u;
+            return h;
+        }
+
+        /// returns the id of the name, adding it if it is not in the table yet
+        unsigned int intern(const char* name, size_t len);
+
+        /// returns the id of the name, or `npos` if it is not in the table
+        unsigned int find(const char* name, size_t len) const;
+
+        /// returns null-terminated name with specified id
+        const char* name(unsigned int id) const { return &m_chars[m_offsets[id]]; }
+
+        /// returns the length of name with specified id
+        size_t length(unsigned int id) const { return m_offsets[id + 1] - m_offsets[id] - 1; }
+
+        /// returns the number of interned names, ids are [0,size())
+        unsigned int size() const { return (unsigned int)m_hashes.size(); }
+    };
+}
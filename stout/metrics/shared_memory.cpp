@@ -0,0 +1,275 @@
+#include "stdafx.h"
+#include "shared_memory.h"
+
+namespace metrics
+{
+    const DWORD shm_magic = 0x4D545454; // changes with the layout of the structures below
+
+    // list of client processes, created by the server
+    struct shm_registry
+    {
+        DWORD magic;
+        DWORD max_clients;
+        volatile LONG server_idle; // see wake_consumer()
+        volatile LONG pids[1]; // max_clients entries, 0 marks a free slot
+    };
+
+    // placed at the start of client mapping, followed by the queue
+    struct shm_queue_header
+    {
+        DWORD magic;
+        DWORD record_size;
+        DWORD capacity;
+        DWORD reserved;
+    };
+
+    void registry_name(char* name, size_t size, unsigned int port)
+    {
+        _snprintf_s(name, size, _TRUNCATE, "Local\\stout.metrics.%u", port);
+    }
+
+    void queue_name(char* name, size_t size, unsigned int port, DWORD pid)
+    {
+        _snprintf_s(name, size, _TRUNCATE, "Local\\stout.metrics.%u.%u", port, pid);
+    }
+
+    void event_name(char* name, size_t size, unsigned int port)
+    {
+        _snprintf_s(name, size, _TRUNCATE, "Local\\stout.metrics.%u.wakeup", port);
+    }
+
+    bool register_pid(shm_registry* reg, DWORD pid)
+    {
+        for (DWORD i = 0; i < reg->max_clients; ++i) {
+            if (InterlockedCompareExchange(&reg->pids[i], (LONG)pid, 0) == 0) return true;
+        }
+        return false;
+    }
+
+    void unregister_pid(shm_registry* reg, DWORD pid)
+    {
+        for (DWORD i = 0; i < reg->max_clients; ++i) {
+            if (InterlockedCompareExchange(&reg->pids[i], 0, (LONG)pid) == (LONG)pid) return;
+        }
+    }
+
+    record_queue* create_shm_client_queue(unsigned int port, unsigned int capacity, volatile LONG** idle, HANDLE* event)
+    {
+        char name[64];
+        event_name(name, _countof(name), port);
+        HANDLE hevent = OpenEvent(EVENT_MODIFY_STATE, FALSE, name);
+        if (!hevent) {
+            dbg_print("no shared memory server at port %u, error: %d", port, GetLastError());
+            return NULL;
+        }
+
+        registry_name(name, _countof(name), port);
+        HANDLE hreg = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, name);
+        if (!hreg) {
+            dbg_print("no shared memory server at port %u, error: %d", port, GetLastError());
+            CloseHandle(hevent);
+            return NULL;
+        }
+
+        shm_registry* reg = (shm_registry*)MapViewOfFile(hreg, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (!reg || reg->magic != shm_magic) {
+            dbg_print("invalid shared memory registry at port %u", port);
+            if (reg) UnmapViewOfFile(reg);
+            CloseHandle(hreg);
+            CloseHandle(hevent);
+            return NULL;
+        }
+
+        DWORD pid = GetCurrentProcessId();
+        size_t size = sizeof(shm_queue_header) + record_queue::memory_size(capacity);
+        queue_name(name, _countof(name), port, pid);
+        HANDLE hq = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, name);
+        if (!hq || GetLastError() == ERROR_ALREADY_EXISTS) {
+            dbg_print("cannot create shared memory queue %s, error: %d", name, GetLastError());
+            if (hq) CloseHandle(hq);
+            UnmapViewOfFile(reg);
+            CloseHandle(hreg);
+            CloseHandle(hevent);
+            return NULL;
+        }
+
+        void* view = MapViewOfFile(hq, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (!view) {
+            dbg_print("cannot map shared memory queue %s, error: %d", name, GetLastError());
+            CloseHandle(hq);
+            UnmapViewOfFile(reg);
+            CloseHandle(hreg);
+            CloseHandle(hevent);
+            return NULL;
+        }
+
+        shm_queue_header* header = static_cast<shm_queue_header*>(view);
+        header->record_size = sizeof(metric_record);
+        header->capacity = record_queue::round_capacity(capacity);
+        record_queue* queue = new record_queue(header + 1, capacity);
+        InterlockedExchange((volatile LONG*)&header->magic, (LONG)shm_magic);
+
+        // registration is the last step, server can attach right after it
+        bool registered = register_pid(reg, pid);
+        CloseHandle(hreg); // the view keeps the registry mapped
+
+        if (!registered) {
+            dbg_print("shared memory registry at port %u is full", port);
+            delete queue;
+            UnmapViewOfFile(view);
+            CloseHandle(hq);
+            UnmapViewOfFile(reg);
+            CloseHandle(hevent);
+            return NULL;
+        }
+
+        // mappings and event stay open for the lifetime of the process
+        dbg_print("created shared memory queue %s", name);
+        *idle = &reg->server_idle;
+        *event = hevent;
+        return queue;
+    }
+
+    shm_server::~shm_server()
+    {
+        FOR_EACH (auto& c, m_clients) release(c);
+        if (m_registry) UnmapViewOfFile(m_registry);
+        if (m_registry_mapping) CloseHandle(m_registry_mapping);
+        if (m_event) CloseHandle(m_event);
+    }
+
+    bool shm_server::create(unsigned int port, unsigned int max_clients)
+    {
+        char name[64];
+        event_name(name, _countof(name), port);
+        m_port = port;
+
+        // created first, clients which find the registry can open it
+        m_event = CreateEvent(NULL, FALSE, FALSE, name);
+        if (!m_event || GetLastError() == ERROR_ALREADY_EXISTS) {
+            dbg_print("cannot create shared memory event %s, error: %d", name, GetLastError());
+            if (m_event) CloseHandle(m_event);
+            m_event = NULL;
+            return false;
+        }
+
+        registry_name(name, _countof(name), port);
+
+        DWORD size = sizeof(shm_registry) + (max_clients - 1) * sizeof(LONG);
+        m_registry_mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, name);
+        if (!m_registry_mapping || GetLastError() == ERROR_ALREADY_EXISTS) {
+            dbg_print("cannot create shared memory registry %s, error: %d", name, GetLastError());
+            if (m_registry_mapping) CloseHandle(m_registry_mapping);
+            m_registry_mapping = NULL;
+            return false;
+        }
+
+        m_registry = (shm_registry*)MapViewOfFile(m_registry_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (!m_registry) {
+            dbg_print("cannot map shared memory registry %s, error: %d", name, GetLastError());
+            CloseHandle(m_registry_mapping);
+            m_registry_mapping = NULL;
+            return false;
+        }
+
+        // new mapping is zero-filled, so all slots are free
+        m_registry->max_clients = max_clients;
+        InterlockedExchange((volatile LONG*)&m_registry->magic, (LONG)shm_magic);
+        dbg_print("created shared memory registry %s", name);
+        return true;
+    }
+
+    bool shm_server::attach(DWORD pid)
+    {
+        client c = { pid, NULL, NULL, NULL, NULL };
+        c.process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+        if (!c.process) {
+            dbg_print("shared memory client %d is gone", pid);
+            return false;
+        }
+
+        char name[64];
+        queue_name(name, _countof(name), m_port, pid);
+        c.mapping = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, name);
+        if (c.mapping) c.view = MapViewOfFile(c.mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+        shm_queue_header* header = static_cast<shm_queue_header*>(c.view);
+        if (!header || header->magic != shm_magic || header->record_size != sizeof(metric_record)) {
+            dbg_print("cannot attach to shared memory queue %s", name);
+            release(c);
+            return false;
+        }
+
+        // the client owns the mapping, so the queue must fit in it before any
+        // cell is read. records themselves are checked when they are drained
+        MEMORY_BASIC_INFORMATION info;
+        c.queue = new record_queue(header + 1);
+        unsigned int capacity = c.queue->capacity();
+        if (capacity != header->capacity || capacity < 2 || (capacity & (capacity - 1)) != 0 ||
+            !VirtualQuery(c.view, &info, sizeof(info)) ||
+            info.RegionSize < sizeof(shm_queue_header) + record_queue::memory_size(capacity)) {
+            dbg_print("invalid shared memory queue %s", name);
+            release(c);
+            return false;
+        }
+
+        m_clients.push_back(c);
+        dbg_print("attached to shared memory queue %s", name);
+        return true;
+    }
+
+    void shm_server::release(client& c)
+    {
+        delete c.queue;
+        if (c.view) UnmapViewOfFile(c.view);
+        if (c.mapping) CloseHandle(c.mapping);
+        if (c.process) CloseHandle(c.process);
+        c.queue = NULL;
+        c.view = c.mapping = c.process = NULL;
+    }
+
+    void shm_server::update_queues()
+    {
+        m_queues.clear();
+        FOR_EACH (auto& c, m_clients) m_queues.push_back(c.queue);
+    }
+
+    void shm_server::refresh(const std::function<void(record_queue*)>& drain)
+    {
+        if (!m_registry) return;
+
+        // clients which exited can't push anymore, so drain what's left
+        for (size_t i = m_clients.size(); i-- > 0;) {
+            client& c = m_clients[i];
+            if (WaitForSingleObject(c.process, 0) != WAIT_OBJECT_0) continue;
+
+            dbg_print("shared memory client %d exited", c.pid);
+            drain(c.queue);
+            unregister_pid(m_registry, c.pid);
+            release(c);
+            m_clients.erase(m_clients.begin() + i);
+        }
+
+        for (DWORD i = 0; i < m_registry->max_clients; ++i) {
+            DWORD pid = (DWORD)m_registry->pids[i];
+            if (pid == 0) continue;
+
+            bool attached = false;
+            FOR_EACH (auto& c, m_clients) if (c.pid == pid) attached = true;
+            if (!attached && !attach(pid)) unregister_pid(m_registry, pid);
+        }
+
+        update_queues();
+    }
+
+    void shm_server::set_idle(bool idle)
+    {
+        if (m_registry) InterlockedExchange(&m_registry->server_idle, idle ? 1 : 0);
+    }
+
+    bool shm_server::has_records() const
+    {
+        FOR_EACH (auto queue, m_queues) if (!queue->empty()) return true;
+        return false;
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include "metric_record.h"
+
+namespace metrics
+{
+    /**
+    * Shared memory transport for clients running on the same host as the
+    * server. Each client process creates a named file mapping holding a
+    * record_queue and registers its pid in the registry mapping created by
+    * the server. The server attaches to registered queues and drains them,
+    * so metrics are delivered without any system call.
+    *
+    * Mapping names are derived from the server port, so several servers can
+    * run on the same host.
+    *
+    * The server waits on a named event when it's idle, and clients signal it
+    * after a push, see wake_consumer(), so the queues don't have to be polled.
+    */
+
+    /// creates the shared memory queue for this process and registers it with
+    /// the server listening at `port`. returns NULL if there is no such server
+    /// or registration fails. the queue lives until the process exits, and so
+    /// do the idle flag and the event of the server returned in `idle` and `event`.
+    record_queue* create_shm_client_queue(unsigned int port, unsigned int capacity, volatile LONG** idle, HANDLE* event);
+
+    /// server side of shared memory transport
+    class shm_server
+    {
+        struct client
+        {
+            DWORD pid;
+            HANDLE process;   // used to detect that client exited
+            HANDLE mapping;
+            void* view;
+            record_queue* queue;
+        };
+
+        unsigned int m_port;
+        HANDLE m_event;           // signalled by clients after a push while the server is idle
+        HANDLE m_registry_mapping;
+        struct shm_registry* m_registry;
+        std::vector<client> m_clients;
+        std::vector<record_queue*> m_queues;
+
+        bool attach(DWORD pid);
+        void release(client& c);
+        void update_queues();
+
+    public:
+        shm_server() : m_port(0), m_event(NULL), m_registry_mapping(NULL), m_registry(NULL) { ; }
+        ~shm_server();
+
+        /// creates the registry where clients announce their queues.
+        /// returns `false` if registry can't be created.
+        bool create(unsigned int port, unsigned int max_clients);
+
+        /**
+        * Attaches to queues of newly registered clients, and releases queues
+        * of clients which exited. `drain` is called for each queue before it
+        * is released, so no metric is lost.
+        */
+        void refresh(const std::function<void(record_queue*)>& drain);
+
+        /// returns queues of all attached clients
+        const std::vector<record_queue*>& queues() const { return m_queues; }
+
+        /// returns the event signalled by clients, NULL if registry wasn't created
+        HANDLE event() const { return m_event; }
+
+        /**
+        * Tells clients whether the server waits for the event. The server
+        * sets it before it checks the queues for the last time, and clears
+        * it when it wakes up.
+        */
+        void set_idle(bool idle);
+
+        /// returns `true` if any queue has records to drain
+        bool has_records() const;
+
+    private:
+        shm_server(const shm_server&);
+        shm_server& operator=(const shm_server&);
+    };
+}
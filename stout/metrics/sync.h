@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Winsock2.h"
+
+namespace metrics
+{
+    /// thin wrapper around CRITICAL_SECTION, used internally by metrics client
+    /// and server
+    class critical_section
+    {
+        CRITICAL_SECTION m_cs;
+
+    public:
+        critical_section() { InitializeCriticalSectionAndSpinCount(&m_cs, 1000); }
+        ~critical_section() { DeleteCriticalSection(&m_cs); }
+
+        void lock() { EnterCriticalSection(&m_cs); }
+        void unlock() { LeaveCriticalSection(&m_cs); }
+
+    private:
+        critical_section(const critical_section&);
+        critical_section& operator=(const critical_section&);
+    };
+
+    /// locks the critical section for the lifetime of the object
+    class scoped_lock
+    {
+        critical_section& m_cs;
+
+    public:
+        explicit scoped_lock(critical_section& cs) : m_cs(cs) { m_cs.lock(); }
+        ~scoped_lock() { m_cs.unlock(); }
+
+    private:
+        scoped_lock(const scoped_lock&);
+        scoped_lock& operator=(const scoped_lock&);
+    };
+}
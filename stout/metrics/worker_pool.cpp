@@ -0,0 +1,86 @@
+#include "stdafx.h"
+#include "worker_pool.h"
+#include "metrics.h"
+
+namespace metrics
+{
+    worker_pool::worker_pool(unsigned int threads) :
+        m_start(CreateSemaphore(NULL, 0, LONG_MAX, NULL)),
+        m_done(CreateEvent(NULL, FALSE, FALSE, NULL)),
+        m_task(NULL),
+        m_claim(0),
+        m_remaining(0),
+        m_stop(0)
+    {
+        if (!m_start || !m_done) {
+            dbg_print("cannot create worker pool events, error: %d", GetLastError());
+            return; // run() falls back to the calling thread
+        }
+
+        for (unsigned int i = 0; i < threads; ++i) {
+            HANDLE h = CreateThread(NULL, 0, worker_proc, this, 0, NULL);
+            if (!h) {
+                dbg_print("cannot start worker thread, error: %d", GetLastError());
+                break;
+            }
+            m_threads.push_back(h);
+        }
+    }
+
+    worker_pool::~worker_pool()
+    {
+        InterlockedExchange(&m_stop, 1);
+        if (!m_threads.empty()) {
+            ReleaseSemaphore(m_start, (LONG)m_threads.size(), NULL);
+            FOR_EACH (auto h, m_threads) {
+                WaitForSingleObject(h, INFINITE);
+                CloseHandle(h);
+            }
+        }
+        if (m_start) CloseHandle(m_start);
+        if (m_done) CloseHandle(m_done);
+    }
+
+    DWORD WINAPI worker_pool::worker_proc(LPVOID params)
+    {
+        worker_pool* pool = static_cast<worker_pool*>(params);
+        while (WaitForSingleObject(pool->m_start, INFINITE) == WAIT_OBJECT_0 && !pool->m_stop) {
+            pool->work(); // a late wakeup finds no parts left
+        }
+        return 0;
+    }
+
+    // the number of parts and the next part change together, so a worker
+    // woken late for a previous run can't take a part of the current one
+    // which was already taken
+    void worker_pool::work()
+    {
+        for (;;) {
+            LONGLONG claim = InterlockedCompareExchange64(&m_claim, 0, 0); // atomic read
+            LONG part = (LONG)(claim & 0xffffffff);
+            if (part >= (LONG)(claim >> 32)) return;
+            if (InterlockedCompareExchange64(&m_claim, claim + 1, claim) != claim) continue;
+
+            (*m_task)((unsigned int)part);
+            if (InterlockedDecrement(&m_remaining) == 0) SetEvent(m_done);
+        }
+    }
+
+    void worker_pool::run(unsigned int parts, const std::function<void(unsigned int)>& task)
+    {
+        if (parts == 0) return;
+        if (m_threads.empty() || parts == 1) {
+            for (unsigned int i = 0; i < parts; ++i) task(i);
+            return;
+        }
+
+        // m_claim is published last, workers don't take parts before that
+        m_task = &task;
+        m_remaining = (LONG)parts;
+        InterlockedExchange64(&m_claim, (LONGLONG)parts << 32);
+
+        ReleaseSemaphore(m_start, (LONG)m_threads.size(), NULL);
+        work();
+        WaitForSingleObject(m_done, INFINITE); // set exactly once per run, by whoever finished last
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include "Winsock2.h"
+
+namespace metrics
+{
+    /**
+    * Small pool of threads for splitting a computation into independent
+    * parts. run() hands out the parts to workers and to the calling thread,
+    * and returns once all of them are done. Parts must not depend on each
+    * other, so results can be written to separate slots without locking.
+    *
+    * run() must be called from one thread at a time.
+    */
+    class worker_pool
+    {
+        std::vector<HANDLE> m_threads;
+        HANDLE m_start;             // semaphore, released once per worker for each run
+        HANDLE m_done;              // set when the last part of a run is finished
+        const std::function<void(unsigned int)>* volatile m_task;
+        volatile LONGLONG m_claim;  // parts of the run in the high half, next part to be taken in the low half
+        volatile LONG m_remaining;  // parts not finished yet
+        volatile LONG m_stop;
+
+        static DWORD WINAPI worker_proc(LPVOID params);
+        void work();
+
+    public:
+        /// starts the specified number of worker threads
+        explicit worker_pool(unsigned int threads);
+        ~worker_pool();
+
+        /// returns the number of worker threads, not counting the caller
+        unsigned int size() const { return (unsigned int)m_threads.size(); }
+
+        /// calls `task(i)` for each i in [0,parts) and waits until all calls return
+        void run(unsigned int parts, const std::function<void(unsigned int)>& task);
+
+    private:
+        worker_pool(const worker_pool&);
+        worker_pool& operator=(const worker_pool&);
+    };
+}
@@ -7,7 +7,7 @@
 monitoring_backend::monitoring_backend(const config& cfg) : m_cfg(cfg)
 {
     m_baseline.timestamp = 0;
-    m_started_at = GetTickCount();
+    m_started_at = metrics::timer::now();
 }
 
 monitoring_backend::~monitoring_backend()
@@ -21,7 +21,7 @@ validator create_validator(const watch& watch, const proc_info& proc)
 
 void monitoring_backend::operator()(const metrics::stats& stats)
 {
-    auto delay = GetTickCount() - m_started_at;
+    auto delay = metrics::timer::since_ms(m_started_at);
     // skip flushing which happens during initial delay and baseline sampling
     // as they won't contain relevant data
     if (delay < (m_cfg.initial_delay() + m_cfg.sampling_time() - 1) * 1000) return;
@@ -53,32 +53,38 @@ void monitoring_backend::operator()(const metrics::stats& stats)
     }      
 }
 
-double get_value(metrics::timer_data data, e_metric_value value_type)
+double get_value(const metrics::timer_columns& t, size_t row, e_metric_value value_type)
 {
     switch (value_type)
     {
-        case avg_value: return data.avg;
-        case min_value: return data.min;
-        case max_value: return data.max;
-        case stddev_value:  return data.stddev;
+        case avg_value: return t.avg[row];
+        case min_value: return t.min[row];
+        case max_value: return t.max[row];
+        case stddev_value:  return t.stddev[row];
+        case p50_value: return t.p50[row];
+        case p90_value: return t.p90[row];
+        case p99_value: return t.p99[row];
+        case p999_value: return t.p999[row];
         default: return 0;
     }
 }
 
-bool validator::validate(metrics::stats base, metrics::stats current)
+bool validator::validate(const metrics::stats& base, const metrics::stats& current)
 {
     std::string prefix = "stout." + proc.id + "." + watch.counter;
 
-    for (const auto& pair : current.timers) {
-        auto counter = pair.first;
-        auto timer_data = pair.second;
-        if (counter.find(prefix) != 0) continue;
+    // series ids are shared by snapshots, so baseline rows are found by id
+    const metrics::timer_columns& timers = current.timers;
+    for (size_t row = 0; row < timers.size(); ++row) {
+        auto series = timers.series[row];
+        const char* counter = current.name(series);
+        if (strncmp(counter, prefix.c_str(), prefix.size()) != 0) continue;
 
-        auto base_data = base.timers[counter];
-        if (base_data.metric == "") continue; // didn't exist in baseline
+        auto base_row = base.timers.find(series);
+        if (base_row == metrics::series_columns::npos) continue; // didn't exist in baseline
 
-        auto base_val = get_value(base_data, watch.value_type);
-        auto curr_val = get_value(timer_data, watch.value_type);
+        auto base_val = get_value(base.timers, base_row, watch.value_type);
+        auto curr_val = get_value(timers, row, watch.value_type);
 
         auto diff = curr_val - base_val;
         auto diff_percent = 0.0;
@@ -90,7 +96,7 @@ bool validator::validate(metrics::stats base, metrics::stats current)
             printf("ERROR: proc %s failed at metric: %s\n",
                    proc.id.c_str(), watch.to_string().c_str());
             printf("       %s baseline: %g -> current: %g\n",
-                   counter.c_str(), base_val, curr_val);
+                   counter, base_val, curr_val);
 
             return false;
         }
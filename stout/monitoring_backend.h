@@ -8,7 +8,7 @@ class config;
 struct validator {
     watch watch;
     proc_info proc;
-    bool validate(metrics::stats base, metrics::stats current);
+    bool validate(const metrics::stats& base, const metrics::stats& current);
 };
 
 class monitoring_backend
@@ -21,7 +21,7 @@ public:
 private:
     metrics::stats m_baseline;
     const config& m_cfg;
-    int m_started_at;
+    metrics::timer::time_point m_started_at;
 
     bool check(const std::string& which, metrics::timer_data base, metrics::timer_data current);
 
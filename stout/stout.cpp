@@ -16,19 +16,45 @@
 
 using namespace metrics;
 
+// adds backends listed in [STOUT::BACKENDS] section
+void add_backends(metrics::server_config& server_cfg, const config& cfg)
+{
+    for (const auto& be : cfg.backends()) {
+        char name[64];
+        strncpy_s(name, be.name.c_str(), _TRUNCATE);
+        _strlwr_s(name); // used in names of internal metrics
+        backend_options options(name, be.queue_size, be.drop_newest ? drop_newest : drop_oldest, be.slow_ms);
+        file_options file(1024 * 1024, be.sync_every, be.rotate_mb * 1024ULL * 1024, be.rotate_keep);
+
+        bool needs_file = !_strcmpi(name, "file") || !_strcmpi(name, "json") || !_strcmpi(name, "csv") ||
+                          !_strcmpi(name, "arrow");
+        if (needs_file && be.target.empty()) {
+            std::string err_msg = "Backend " + be.name + " requires a file name";
+            throw stout_exception(err_msg.c_str());
+        }
+
+        if (!_strcmpi(name, "console")) server_cfg.add_backend(console_backend(), options);
+        else if (!_strcmpi(name, "file")) server_cfg.add_backend(file_backend(be.target.c_str(), file), options);
+        else if (!_strcmpi(name, "json")) server_cfg.add_backend(json_file_backend(be.target.c_str(), file, be.ndjson ? json_lines : json_pretty), options);
+        else if (!_strcmpi(name, "csv")) server_cfg.add_backend(csv_backend(be.target.c_str(), file), options);
+        else if (!_strcmpi(name, "arrow")) server_cfg.add_backend(arrow_backend(be.target.c_str(), file), options);
+        else printf("backend %s is not supported, ignored\n", be.name.c_str());
+    }
+}
+
 metrics::server start_server(const config& cfg)
 {
     auto on_flush = [] { printf("flushing!"); }; // check differences
 
-    console_backend console;
     monitoring_backend mon(cfg);
-    json_file_backend json("d:\\load.json");
 
     auto server_cfg = metrics::server_config(cfg.server_port())
         //.pre_flush(on_flush) 
         .flush_every(cfg.sampling_time())
-        .add_backend(mon)
-        .add_backend(json);
+        .flush_threads(cfg.flush_threads())
+        .enable_inproc()    // collector runs in this process
+        .add_backend(mon, backend_options("monitoring"));
+    add_backends(server_cfg, cfg);
 
     return server::run(server_cfg);
 }
@@ -52,7 +78,7 @@ int _tmain(int argc, _TCHAR* argv[])
         collector collector(cfg, runner);
 
         auto server = start_server(cfg);  
-        metrics::setup_client("localhost", cfg.server_port())
+        metrics::setup_client(server)
             .set_namespace("stout")
             .track_default_metrics(metrics::none);
         printf("starting applications...\n");